@@ -17,11 +17,58 @@
 // SOFTWARE.
 
 #include "shannon1948.hpp"
-#include "gtest/gtest.h"
 
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
 #include <map>
 #include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#include <bcrypt.h>
+#if defined(_MSC_VER)
+#pragma comment(lib, "bcrypt.lib")
+#endif
+#elif defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || \
+   defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define SHANNON1948_TARGET(feature)
+#else
+#include <cpuid.h>
+#define SHANNON1948_TARGET(feature) __attribute__((target(feature)))
+#endif
+#define SHANNON1948_X86
+#if defined(__x86_64__) || defined(_M_X64)
+#define SHANNON1948_X64
+#endif
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+   (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SHANNON1948_SSE2
+#endif
 
 using namespace shannon1948;
 
@@ -35,10 +82,10 @@ using namespace shannon1948;
 
    for (size_t i = 0; i < length; i++)
    {
-      // TODO: Switch to a better random number generator / experiment with
-      // different generators.  Any experiment here is highly dependent on
-      // having a true random number source, so experiments may really only
-      // be measuring the entropy of the PRNG.
+      // Any experiment here is highly dependent on having a true random
+      // number source, or it may only be measuring the entropy of rand().
+      // The versions that take a RandomEngine can draw from SystemEngine or
+      // HardwareEngine instead.
 
       int r = rand(); // 0 to RAND_MAX, inclusive of both endpoints
       while (r == RAND_MAX) // don't allow RAND_MAX
@@ -47,40 +94,4556 @@ using namespace shannon1948;
    }
 }
 
-/* static */ double EntropyCalculator::G_N(std::string message, size_t N)
+namespace
 {
-   size_t message_length = message.length();
+   // random words are drawn from engines in batches of this many
+   const size_t RANDOM_BATCH = 256;
 
-   if (N == 0)
-      throw std::exception("N must be greater than zero");
-   if (N > message_length)
-      throw std::exception("N must be less than or equal to message length");
+   // UnitInterval maps a random word to a double uniformly distributed in
+   // [0, 1), using its 53 high bits.
+   inline double UnitInterval(uint64_t word)
+   {
+      return double(word >> 11)*(1.0/9007199254740992.0);
+   }
+
+   // SplitMix64 steps a simple generator, used to spread a seed over the
+   // state of another generator.
+   uint64_t SplitMix64(uint64_t& state)
+   {
+      uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+      z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ULL;
+      z = (z ^ (z >> 27))*0x94D049BB133111EBULL;
+      return z ^ (z >> 31);
+   }
+
+   // MultiplyHigh is the high 64 bits of the 128-bit product of a and b.
+   inline uint64_t MultiplyHigh(uint64_t a, uint64_t b)
+   {
+#if defined(__SIZEOF_INT128__)
+      return uint64_t((unsigned __int128)a*b >> 64);
+#else
+      uint64_t a_low = a & 0xFFFFFFFF, a_high = a >> 32;
+      uint64_t b_low = b & 0xFFFFFFFF, b_high = b >> 32;
+      uint64_t low = a_low*b_low;
+      uint64_t middle1 = a_high*b_low + (low >> 32);
+      uint64_t middle2 = a_low*b_high + (middle1 & 0xFFFFFFFF);
+      return a_high*b_high + (middle1 >> 32) + (middle2 >> 32);
+#endif
+   }
+}
 
-   // count all sequences of length N
+Xoshiro256StarStar::Xoshiro256StarStar(uint64_t seed)
+{
+   Seed(seed);
+}
 
-   std::map<std::string, size_t> sequence_counts;
-   size_t samples = 0; // the final number of samples taken from the message
+Xoshiro256StarStar::Xoshiro256StarStar(
+   uint64_t s0, uint64_t s1, uint64_t s2, uint64_t s3)
+{
+   if ((s0 | s1 | s2 | s3) == 0)
+      throw std::exception("the state must not be all zeros");
+   s_[0] = s0;
+   s_[1] = s1;
+   s_[2] = s2;
+   s_[3] = s3;
+}
 
-   while (samples + N <= message_length)
-      ++sequence_counts[message.substr(samples++, N)];
+void Xoshiro256StarStar::Seed(uint64_t seed)
+{
+   for (int i = 0; i < 4; i++)
+      s_[i] = SplitMix64(seed);
+}
 
-   // The probability of a sequence, p(B_i), is determined by its number of
-   // occurences in the message as a fraction of the total number of samples
-   // taken from the message.  This calculation assumes that "impossible"
-   // sequences (those not found in this message) do not contribute to the sum.
+void Xoshiro256StarStar::Fill(uint64_t* words, size_t count)
+{
+   // a copy of the state, which stores to words cannot alias, so that it
+   // stays in registers
+   Xoshiro256StarStar engine(*this);
+   for (size_t i = 0; i < count; i++)
+      words[i] = engine();
+   *this = engine;
+}
 
-   double sum = 0.0;
-   for (auto it = sequence_counts.begin(); it != sequence_counts.end(); it++)
+namespace
+{
+   const uint64_t PCG_MULTIPLIER_HIGH = 0x2360ED051FC65DA4ULL;
+   const uint64_t PCG_MULTIPLIER_LOW = 0x4385DF649FCCF645ULL;
+}
+
+Pcg64::Pcg64(uint64_t seed, uint64_t stream)
+{
+   Seed(seed, stream);
+}
+
+void Pcg64::Seed(uint64_t seed, uint64_t stream)
+{
+   // as pcg_setseq_128_srandom_r in the PCG C library
+   increment_high_ = stream >> 63;
+   increment_low_ = (stream << 1) | 1;
+   state_high_ = 0;
+   state_low_ = 0;
+   Step();
+   state_low_ += seed;
+   if (state_low_ < seed)
+      ++state_high_;
+   Step();
+}
+
+void Pcg64::Step()
+{
+   // state = state*multiplier + increment, modulo 2^128
+   uint64_t high = MultiplyHigh(state_low_, PCG_MULTIPLIER_LOW) +
+      state_low_*PCG_MULTIPLIER_HIGH + state_high_*PCG_MULTIPLIER_LOW;
+   uint64_t low = state_low_*PCG_MULTIPLIER_LOW;
+
+   state_low_ = low + increment_low_;
+   state_high_ = high + increment_high_ + (state_low_ < low ? 1 : 0);
+}
+
+Pcg64::result_type Pcg64::operator()()
+{
+   Step();
+   uint64_t x = state_high_ ^ state_low_;
+   unsigned rotation = unsigned(state_high_ >> 58);
+   return (x >> rotation) | (x << ((64 - rotation) & 63));
+}
+
+void Pcg64::Fill(uint64_t* words, size_t count)
+{
+   for (size_t i = 0; i < count; i++)
+      words[i] = (*this)();
+}
+
+namespace
+{
+   // RandomWords hands out the words of an engine one at a time, drawing
+   // them in batches.
+
+   class RandomWords
+   {
+   public:
+
+      explicit RandomWords(RandomEngine& engine)
+         : engine_(engine), next_(RANDOM_BATCH) {}
+
+      uint64_t Next()
+      {
+         if (next_ == RANDOM_BATCH)
+         {
+            engine_.Fill(words_, RANDOM_BATCH);
+            next_ = 0;
+         }
+         return words_[next_++];
+      }
+
+   private:
+
+      RandomEngine& engine_;
+      uint64_t words_[RANDOM_BATCH];
+      size_t next_;
+   };
+
+   // BernoulliWords makes words of 64 independent bits that are each 1 with
+   // probability p.  Bit i of the result is 1 if the uniform number whose
+   // binary digits are bit i of successive random words is less than p.
+   // Digit j decides the comparisons whose digit differs from digit j of p;
+   // the rest stay undecided.  Once the remaining digits of p are all zero,
+   // the undecided numbers are at least p.
+
+   class BernoulliWords
+   {
+   public:
+
+      explicit BernoulliWords(double p)
+         : all_(p >= 1.0), fixed_(0)
+      {
+         if (p > 0.0 && p < 1.0)
+            fixed_ = uint64_t(ldexp(p, 64)); // the first 64 digits of p
+      }
+
+      template <typename Words>
+      uint64_t Next(Words& random) const
+      {
+         if (all_)
+            return ~uint64_t(0);
+
+         uint64_t result = 0;
+         uint64_t undecided = ~uint64_t(0);
+         for (uint64_t digits = fixed_; digits != 0 && undecided != 0;
+            digits <<= 1)
+         {
+            uint64_t r = random.Next();
+            if (digits >> 63)
+            {
+               uint64_t below = undecided & ~r; // digit 0 where p has a 1
+               result |= below;
+               undecided &= r;
+            }
+            else
+            {
+               undecided &= ~r; // digit 1 where p has a 0
+            }
+         }
+         return result;
+      }
+
+   private:
+
+      bool all_;
+      uint64_t fixed_;
+   };
+
+   // SymbolBytes expands each bit of a byte to 'A' for 1 or 'B' for 0,
+   // least significant bit first.
+
+   struct SymbolBytes
+   {
+      SymbolBytes()
+      {
+         for (int byte = 0; byte < 256; byte++)
+            for (int bit = 0; bit < 8; bit++)
+               symbols[byte][bit] = ((byte >> bit) & 1) ? 'A' : 'B';
+      }
+
+      char symbols[256][8];
+   };
+
+   const SymbolBytes SYMBOL_BYTES;
+
+   inline void ExpandWord(uint64_t word, char* output, size_t length)
+   {
+      for (size_t i = 0; i < length; i += 8, word >>= 8)
+         memcpy(output + i, SYMBOL_BYTES.symbols[word & 0xFF],
+            std::min(size_t(8), length - i));
+   }
+
+   // PackWord turns the low bytes of word, whose bits are symbols least
+   // significant first as ExpandWord takes them, into packed bytes with
+   // the first symbol in the most significant bit, as NGramCounter reads
+   // them.
+   inline uint64_t PackWord(uint64_t word)
+   {
+      word = (word & 0xF0F0F0F0F0F0F0F0ULL) >> 4 |
+         (word & 0x0F0F0F0F0F0F0F0FULL) << 4;
+      word = (word & 0xCCCCCCCCCCCCCCCCULL) >> 2 |
+         (word & 0x3333333333333333ULL) << 2;
+      word = (word & 0xAAAAAAAAAAAAAAAAULL) >> 1 |
+         (word & 0x5555555555555555ULL) << 1;
+      return word;
+   }
+
+   // Below this probability of the rarer symbol, a binary message is
+   // generated as runs rather than 64 symbols at a time.
+   const double SKEWED_P = 1.0/64;
+   const double MAX_RUN = 4611686018427387904.0; // 2^62
+
+   // GeometricRuns generates a skewed binary message as runs of the common
+   // symbol, each ended by the rare one, which has probability q.  A run is
+   // k long with probability (1-q)^k q, so its length is drawn by inverting
+   // the geometric distribution with a single random word.
+
+   class GeometricRuns
+   {
+   public:
+
+      explicit GeometricRuns(double q)
+         : log_common_(log1p(-q)) {}
+
+      uint64_t Next(RandomWords& random) const
+      {
+         // u < 1, so log(1 - u) is finite; runs are capped well short of
+         // overflowing when added to a position
+         double run = floor(log1p(-UnitInterval(random.Next()))/log_common_);
+         return run < MAX_RUN ? uint64_t(run) : uint64_t(MAX_RUN);
+      }
+
+   private:
+
+      double log_common_;
+   };
+
+   // Skewed tells whether p is close enough to 0 or 1 for GeometricRuns.
+   inline bool Skewed(double p)
+   {
+      double q = std::min(p, 1.0 - p);
+      return q > 0.0 && q < SKEWED_P;
+   }
+}
+
+SystemEngine::SystemEngine()
+   : file_(-1)
+{
+#if defined(__linux__) && defined(SYS_getrandom)
+   uint64_t word;
+   if (syscall(SYS_getrandom, &word, sizeof(word), 0) == long(sizeof(word)))
+      return; // getrandom works, so no file is needed
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+   file_ = open("/dev/urandom", O_RDONLY);
+   if (file_ == -1)
+      throw std::exception("cannot open /dev/urandom");
+#endif
+}
+
+SystemEngine::~SystemEngine()
+{
+#if defined(__unix__) || defined(__APPLE__)
+   if (file_ != -1)
+      close(file_);
+#endif
+}
+
+void SystemEngine::Fill(uint64_t* words, size_t count)
+{
+   char* output = (char*)words;
+   size_t length = count*sizeof(uint64_t);
+
+#if defined(_WIN32)
+   while (length != 0)
+   {
+      ULONG part = ULONG(std::min(length, size_t(1) << 30));
+      if (BCryptGenRandom(0, (PUCHAR)output, part,
+         BCRYPT_USE_SYSTEM_PREFERRED_RNG) != 0)
+         throw std::exception("BCryptGenRandom failed");
+      output += part;
+      length -= part;
+   }
+#elif defined(__unix__) || defined(__APPLE__)
+   while (length != 0)
+   {
+      long got;
+#if defined(__linux__) && defined(SYS_getrandom)
+      if (file_ == -1)
+         got = syscall(SYS_getrandom, output, length, 0);
+      else
+#endif
+         got = long(read(file_, output, length));
+
+      if (got < 0 && errno == EINTR)
+         continue;
+      if (got <= 0)
+         throw std::exception("cannot read the system's random source");
+      output += got;
+      length -= size_t(got);
+   }
+#else
+   (void)output;
+   (void)length;
+   throw std::exception("there is no system random source");
+#endif
+}
+
+namespace
+{
+   // RDRAND fails only if it is called faster than it is reseeded, so a few
+   // tries are enough; RDSEED can fail for longer.
+   const int RDRAND_TRIES = 10;
+   const int RDSEED_TRIES = 10000;
+
+#if defined(SHANNON1948_X64)
+   SHANNON1948_TARGET("rdrnd") bool RdrandStep(uint64_t& word)
+   {
+      unsigned long long value;
+      bool ok = _rdrand64_step(&value) != 0;
+      word = value;
+      return ok;
+   }
+
+   SHANNON1948_TARGET("rdseed") bool RdseedStep(uint64_t& word)
+   {
+      unsigned long long value;
+      bool ok = _rdseed64_step(&value) != 0;
+      word = value;
+      return ok;
+   }
+#elif defined(SHANNON1948_X86)
+   // 32-bit processors have only the 32-bit forms, so a word takes two;
+   // if the second fails, the first is drawn again with it.
+
+   SHANNON1948_TARGET("rdrnd") bool RdrandStep(uint64_t& word)
+   {
+      unsigned int high, low;
+      bool ok = _rdrand32_step(&high) != 0 && _rdrand32_step(&low) != 0;
+      word = uint64_t(high) << 32 | low;
+      return ok;
+   }
+
+   SHANNON1948_TARGET("rdseed") bool RdseedStep(uint64_t& word)
+   {
+      unsigned int high, low;
+      bool ok = _rdseed32_step(&high) != 0 && _rdseed32_step(&low) != 0;
+      word = uint64_t(high) << 32 | low;
+      return ok;
+   }
+#endif
+}
+
+/* static */ bool HardwareEngine::Supported(Instruction instruction)
+{
+#if defined(SHANNON1948_X86) && defined(_MSC_VER)
+   int registers[4];
+   if (instruction == RDRAND)
+   {
+      __cpuid(registers, 1);
+      return (registers[2] >> 30) & 1;
+   }
+   __cpuid(registers, 0);
+   if (registers[0] < 7)
+      return false;
+   __cpuidex(registers, 7, 0);
+   return (registers[1] >> 18) & 1;
+#elif defined(SHANNON1948_X86)
+   unsigned a, b, c, d;
+   if (instruction == RDRAND)
+      return __get_cpuid(1, &a, &b, &c, &d) && ((c >> 30) & 1);
+   if (__get_cpuid_max(0, 0) < 7)
+      return false;
+   __cpuid_count(7, 0, a, b, c, d);
+   return (b >> 18) & 1;
+#else
+   (void)instruction;
+   return false;
+#endif
+}
+
+HardwareEngine::HardwareEngine(Instruction instruction)
+   : instruction_(instruction)
+{
+   if (!Supported(instruction))
+      throw std::exception("the processor lacks the random instruction");
+}
+
+void HardwareEngine::Fill(uint64_t* words, size_t count)
+{
+#if defined(SHANNON1948_X86)
+   bool seed = instruction_ == RDSEED;
+   int tries = seed ? RDSEED_TRIES : RDRAND_TRIES;
+   for (size_t i = 0; i < count; i++)
+   {
+      int tried = 0;
+      while (!(seed ? RdseedStep(words[i]) : RdrandStep(words[i])))
+      {
+         if (++tried == tries)
+            throw std::exception("the random instruction kept failing");
+         _mm_pause();
+      }
+   }
+#else
+   (void)words;
+   (void)count;
+   throw std::exception("the processor lacks the random instruction");
+#endif
+}
+
+// The source fills buffers[0] and buffers[1] in turn, each once it has been
+// handed out.
+
+struct BufferedEngine::Shared
+{
+   explicit Shared(RandomEngine& engine, size_t batch)
+      : source(engine), current(0), position(0), stop(false)
+   {
+      buffers[0].resize(batch);
+      buffers[1].resize(batch);
+      filled[0] = filled[1] = false;
+   }
+
+   RandomEngine& source;
+   std::vector<uint64_t> buffers[2];
+   bool filled[2];
+   size_t current;  // the buffer being handed out
+   size_t position; // the next word of it
+   bool stop;
+   std::exception_ptr failure;
+   std::mutex mutex;
+   std::condition_variable changed;
+   std::thread thread;
+
+private:
+
+   Shared& operator=(const Shared&); // not assignable
+};
+
+const size_t BufferedEngine::DEFAULT_BATCH;
+
+BufferedEngine::BufferedEngine(RandomEngine& source, size_t batch)
+   : shared_(new Shared(source, std::max(batch, size_t(1))))
+{
+   Shared& shared = *shared_;
+   shared.thread = std::thread([&shared]()
+   {
+      try
+      {
+         for (size_t b = 0; ; b ^= 1)
+         {
+            {
+               std::unique_lock<std::mutex> lock(shared.mutex);
+               shared.changed.wait(lock,
+                  [&]() { return !shared.filled[b] || shared.stop; });
+               if (shared.stop)
+                  return;
+            }
+
+            shared.source.Fill(&shared.buffers[b][0],
+               shared.buffers[b].size());
+
+            std::lock_guard<std::mutex> lock(shared.mutex);
+            shared.filled[b] = true;
+            shared.changed.notify_all();
+         }
+      }
+      catch (...)
+      {
+         std::lock_guard<std::mutex> lock(shared.mutex);
+         shared.failure = std::current_exception();
+         shared.changed.notify_all();
+      }
+   });
+}
+
+BufferedEngine::~BufferedEngine()
+{
+   {
+      std::lock_guard<std::mutex> lock(shared_->mutex);
+      shared_->stop = true;
+      shared_->changed.notify_all();
+   }
+   shared_->thread.join();
+   delete shared_;
+}
+
+void BufferedEngine::Fill(uint64_t* words, size_t count)
+{
+   Shared& shared = *shared_;
+   size_t batch = shared.buffers[0].size();
+
+   while (count != 0)
+   {
+      if (shared.position == batch)
+      {
+         std::lock_guard<std::mutex> lock(shared.mutex);
+         shared.filled[shared.current] = false;
+         shared.current ^= 1;
+         shared.position = 0;
+         shared.changed.notify_all();
+      }
+
+      if (shared.position == 0)
+      {
+         std::unique_lock<std::mutex> lock(shared.mutex);
+         shared.changed.wait(lock, [&]()
+            { return shared.filled[shared.current] || shared.failure; });
+         if (!shared.filled[shared.current])
+            std::rethrow_exception(shared.failure);
+      }
+
+      size_t part = std::min(count, batch - shared.position);
+      memcpy(words, &shared.buffers[shared.current][shared.position],
+         part*sizeof(uint64_t));
+      shared.position += part;
+      words += part;
+      count -= part;
+   }
+}
+
+namespace
+{
+   const uint64_t PHILOX_M0 = 0xD2E7470EE14C6C93ULL;
+   const uint64_t PHILOX_M1 = 0xCA5A826395121157ULL;
+   const uint64_t PHILOX_W0 = 0x9E3779B97F4A7C15ULL;
+   const uint64_t PHILOX_W1 = 0xBB67AE8584CAA73BULL;
+   const int PHILOX_ROUNDS = 10;
+}
+
+/* static */ void Philox4x64::Block(const uint64_t counter[4],
+   const uint64_t key[2], uint64_t output[4])
+{
+   uint64_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+   uint64_t k0 = key[0], k1 = key[1];
+
+   for (int round = 0; round < PHILOX_ROUNDS; round++)
+   {
+      if (round != 0)
+      {
+         k0 += PHILOX_W0;
+         k1 += PHILOX_W1;
+      }
+
+      uint64_t high0 = MultiplyHigh(PHILOX_M0, c0);
+      uint64_t low0 = PHILOX_M0*c0;
+      uint64_t high1 = MultiplyHigh(PHILOX_M1, c2);
+      uint64_t low1 = PHILOX_M1*c2;
+
+      c0 = high1 ^ c1 ^ k0;
+      c1 = low1;
+      c2 = high0 ^ c3 ^ k1;
+      c3 = low0;
+   }
+
+   output[0] = c0;
+   output[1] = c1;
+   output[2] = c2;
+   output[3] = c3;
+}
+
+Philox4x64::Philox4x64(uint64_t seed, uint64_t stream)
+{
+   key_[0] = seed;
+   key_[1] = 0;
+   counter_[0] = 0;
+   counter_[1] = stream;
+   counter_[2] = 0;
+   counter_[3] = 0;
+   Seek(0);
+}
+
+void Philox4x64::Seek(uint64_t position)
+{
+   counter_[0] = position/4;
+   Block(counter_, key_, block_);
+   used_ = unsigned(position % 4);
+}
+
+void Philox4x64::Fill(uint64_t* words, size_t count)
+{
+   for (size_t i = 0; i < count; i++)
+   {
+      if (used_ == 4)
+      {
+         ++counter_[0];
+         Block(counter_, key_, block_);
+         used_ = 0;
+      }
+      words[i] = block_[used_++];
+   }
+}
+
+/* static */ void EntropySource::GenerateBinaryMessage(RandomEngine& engine,
+   double p, size_t length, std::string& message)
+{
+   if (length == 0)
+      throw std::exception("length must be greater than zero");
+
+   size_t start = message.length();
+   message.resize(start + length);
+   char* output = &message[start];
+
+   RandomWords random(engine);
+
+   if (Skewed(p))
+   {
+      // runs of the common symbol are filled at once
+      char common = p < 0.5 ? 'B' : 'A';
+      char rare = p < 0.5 ? 'A' : 'B';
+      GeometricRuns runs(std::min(p, 1.0 - p));
+      for (size_t i = 0; i < length; )
+      {
+         size_t run =
+            size_t(std::min(runs.Next(random), uint64_t(length - i)));
+         memset(output + i, common, run);
+         i += run;
+         if (i < length)
+            output[i++] = rare;
+      }
+      return;
+   }
+
+   BernoulliWords bernoulli(p);
+   for (size_t i = 0; i < length; i += 64)
+      ExpandWord(bernoulli.Next(random), output + i,
+         std::min(size_t(64), length - i));
+}
+
+/* static */ void EntropySource::GenerateBinaryBits(RandomEngine& engine,
+   double p, void* output, size_t length)
+{
+   unsigned char* bytes = (unsigned char*)output;
+
+   RandomWords random(engine);
+
+   if (Skewed(p))
+   {
+      // every bit starts as the common one, and the rare ones are flipped
+      memset(bytes, p < 0.5 ? 0x00 : 0xFF, length);
+      GeometricRuns runs(std::min(p, 1.0 - p));
+      uint64_t bits = 8*uint64_t(length);
+      for (uint64_t i = runs.Next(random); i < bits;
+         i += runs.Next(random) + 1)
+      {
+         bytes[i/8] ^= (unsigned char)(0x80 >> (i % 8));
+      }
+      return;
+   }
+
+   BernoulliWords bernoulli(p);
+   for (size_t i = 0; i < length; i += 8)
+   {
+      uint64_t word = bernoulli.Next(random);
+      for (size_t j = i; j < i + 8 && j < length; j++, word >>= 8)
+         bytes[j] = (unsigned char)word;
+   }
+}
+
+namespace
+{
+   const uint16_t NO_CODE = 0xFFFF;
+
+   // N-gram keys of up to DENSE_BITS bits are always counted in a flat array.
+   // Up to MAX_DENSE_BITS, a flat array is used if it will be well populated.
+   const unsigned DENSE_BITS = 20;
+   const unsigned MAX_DENSE_BITS = 28;
+
+   const size_t INITIAL_TABLE_SIZE = 1024; // must be a power of two
+   const size_t HISTORY_SIZE = 4096; // codes kept for WIDE N-grams, plus N
+
+   // the least number of symbols worth giving a thread of its own
+   const size_t MIN_THREAD_CHUNK = 64*1024;
+
+   const uint64_t GOLDEN_RATIO = 0x9E3779B97F4A7C15ULL; // 2^64/phi
+   const uint64_t ROLLING_PRIME = 0x100000001B3ULL;
+
+   // SymbolBits is the number of bits in the codes of an alphabet.
+   unsigned SymbolBits(size_t symbols)
+   {
+      unsigned bits = 0;
+      while ((size_t(1) << bits) < symbols)
+         ++bits;
+      return bits;
+   }
+
+   // Packable tells whether N codes of the given size fit in a 64-bit key.
+   bool Packable(size_t N, unsigned bits)
+   {
+      return bits == 0 || N <= 64/bits;
+   }
+
+   inline uint64_t RollingHash(const unsigned char* codes, size_t N)
+   {
+      uint64_t hash = 0;
+      for (size_t i = 0; i < N; i++)
+         hash = hash*ROLLING_PRIME + (codes[i] + 1);
+      return hash;
+   }
+
+   inline size_t SlotIndex(uint64_t key, size_t table_size)
+   {
+      uint64_t h = key*GOLDEN_RATIO;
+      return size_t(h ^ (h >> 32)) & (table_size - 1);
+   }
+
+   // FindAlphabet returns the distinct bytes of a message in increasing order.
+   std::string FindAlphabet(const unsigned char* data, size_t length)
+   {
+      bool seen[256] = { false };
+      for (size_t i = 0; i < length; i++)
+         seen[data[i]] = true;
+
+      std::string alphabet;
+      for (int c = 0; c < 256; c++)
+         if (seen[c])
+            alphabet.push_back(char(c));
+
+      return alphabet;
+   }
+
+   // RunParallel calls task(i) for each i in [0, count), each on its own
+   // thread, and rethrows the first exception that any of the calls threw.
+   template <typename Task>
+   void RunParallel(size_t count, Task task)
+   {
+      std::vector<std::exception_ptr> errors(count);
+      std::vector<std::thread> threads;
+      threads.reserve(count);
+
+      for (size_t i = 0; i < count; i++)
+      {
+         threads.push_back(std::thread([&task, &errors, i]()
+         {
+            try
+            {
+               task(i);
+            }
+            catch (...)
+            {
+               errors[i] = std::current_exception();
+            }
+         }));
+      }
+
+      for (size_t i = 0; i < count; i++)
+         threads[i].join();
+      for (size_t i = 0; i < count; i++)
+         if (errors[i])
+            std::rethrow_exception(errors[i]);
+   }
+
+   // ChunkThreads limits the number of threads given to a message so that
+   // each has a worthwhile amount of it.
+   unsigned ChunkThreads(unsigned threads, size_t length)
+   {
+      size_t most = std::max(length/MIN_THREAD_CHUNK, size_t(1));
+      return unsigned(std::min(size_t(std::max(threads, 1u)), most));
+   }
+
+   // FindAlphabet with threads scans separate chunks of the message for
+   // their symbols.
+   std::string FindAlphabet(
+      const unsigned char* data, size_t length, unsigned threads)
    {
-      double p = double(it->second)/samples;
-      sum -= p*log(p); // natural log and use - operator
+      threads = ChunkThreads(threads, length);
+      if (threads == 1)
+         return FindAlphabet(data, length);
+
+      std::vector<std::string> alphabets(threads);
+      RunParallel(threads, [&](size_t i)
+      {
+         size_t begin = length*i/threads;
+         size_t end = length*(i + 1)/threads;
+         alphabets[i] = FindAlphabet(data + begin, end - begin);
+      });
+
+      std::string symbols;
+      for (size_t i = 0; i < alphabets.size(); i++)
+         symbols += alphabets[i];
+      return FindAlphabet(
+         (const unsigned char*)symbols.data(), symbols.length());
    }
+}
+
+namespace
+{
+   // GroupWords hands out the Philox words for one run of 64 symbols: those
+   // of the counters {group, 0, 0, 0}, {group, 1, 0, 0}, and so on.
+
+   class GroupWords
+   {
+   public:
+
+      GroupWords(uint64_t seed, uint64_t group)
+         : used_(4)
+      {
+         key_[0] = seed;
+         key_[1] = 0;
+         counter_[0] = group;
+         counter_[1] = uint64_t(0) - 1; // so the first block is number 0
+         counter_[2] = 0;
+         counter_[3] = 0;
+      }
+
+      uint64_t Next()
+      {
+         if (used_ == 4)
+         {
+            ++counter_[1];
+            Philox4x64::Block(counter_, key_, block_);
+            used_ = 0;
+         }
+         return block_[used_++];
+      }
+
+   private:
+
+      uint64_t key_[2];
+      uint64_t counter_[4];
+      uint64_t block_[4];
+      unsigned used_;
+   };
+}
+
+namespace
+{
+   const size_t FILE_WINDOW = 64*1024*1024;
 
-   return sum/N/log(2.0); // convert to log2 for binary entropy
+   // SeededBinaryWords calls emit(word, offset, count) for each run of 64
+   // symbols of the seeded binary message that overlaps symbols position to
+   // position + length - 1.  The low bits of word are symbols position +
+   // offset onwards, of which count are wanted.  Threads take separate runs.
+   template <typename Emit>
+   void SeededBinaryWords(uint64_t seed, double p, uint64_t position,
+      uint64_t length, unsigned threads, Emit emit)
+   {
+      BernoulliWords bernoulli(p);
+      uint64_t first = position/64;
+      uint64_t groups = (position + length - 1)/64 - first + 1;
+      threads = ChunkThreads(threads, size_t(std::min(length, uint64_t(-1))));
+
+      RunParallel(threads, [&](size_t thread)
+      {
+         for (uint64_t group = first + groups*thread/threads;
+            group < first + groups*(thread + 1)/threads; group++)
+         {
+            GroupWords random(seed, group);
+            uint64_t begin = std::max(64*group, position);
+            uint64_t end = std::min(64*group + 64, position + length);
+            emit(bernoulli.Next(random) >> (begin - 64*group),
+               size_t(begin - position), size_t(end - begin));
+         }
+      });
+   }
 }
 
-int main(int argc, char **argv) {
-  ::testing::InitGoogleTest(&argc, argv);
-  int rv = RUN_ALL_TESTS();
-  return rv;
+/* static */ void EntropySource::GenerateBinaryMessage(uint64_t seed,
+   double p, size_t length, std::string& message, unsigned threads)
+{
+   if (length == 0)
+      throw std::exception("length must be greater than zero");
+
+   size_t start = message.length();
+   message.resize(start + length);
+   GenerateBinaryMessage(seed, p, 0, length, &message[start], threads);
+}
+
+/* static */ void EntropySource::GenerateBinaryMessage(uint64_t seed,
+   double p, uint64_t position, size_t length, char* output, unsigned threads)
+{
+   if (length == 0)
+      throw std::exception("length must be greater than zero");
+
+   SeededBinaryWords(seed, p, position, length, threads,
+      [output](uint64_t word, size_t offset, size_t count)
+   {
+      ExpandWord(word, output + offset, count);
+   });
+}
+
+/* static */ void EntropySource::GenerateBinaryBits(uint64_t seed, double p,
+   uint64_t position, size_t length, void* output, unsigned threads)
+{
+   if (length == 0)
+      throw std::exception("length must be greater than zero");
+
+   unsigned char* bytes = (unsigned char*)output;
+   SeededBinaryWords(seed, p, 8*position, 8*uint64_t(length), threads,
+      [bytes](uint64_t word, size_t offset, size_t count)
+   {
+      word = PackWord(word);
+      for (size_t i = 0; i < count; i += 8, word >>= 8)
+         bytes[(offset + i)/8] = (unsigned char)word;
+   });
+}
+
+/* static */ void EntropySource::GenerateBinaryFile(uint64_t seed, double p,
+   uint64_t length, const std::string& path, unsigned threads, bool bits)
+{
+   if (length == 0)
+      throw std::exception("length must be greater than zero");
+
+   OutputFile file(path, length);
+   for (uint64_t offset = 0; offset < length; offset += FILE_WINDOW)
+   {
+      size_t count = size_t(std::min(uint64_t(FILE_WINDOW), length - offset));
+      char* window = file.Map(offset, count);
+      if (bits)
+         GenerateBinaryBits(seed, p, offset, count, window, threads);
+      else
+         GenerateBinaryMessage(seed, p, offset, count, window, threads);
+      file.Unmap();
+   }
+}
+
+AliasTable::AliasTable(const std::vector<double>& weights)
+{
+   if (weights.empty() || uint64_t(weights.size()) > UINT32_MAX)
+      throw std::exception("the number of weights is out of range");
+
+   double total = 0.0;
+   for (size_t i = 0; i < weights.size(); i++)
+   {
+      if (!(weights[i] >= 0.0)) // also catches NaN
+         throw std::exception("weights must not be negative");
+      total += weights[i];
+   }
+   if (!(total > 0.0) || total > DBL_MAX)
+      throw std::exception("the total weight must be positive and finite");
+
+   // Scale so that the average column is full, then fill each column that
+   // is short from one that is over, which then may become short itself.
+
+   size_t n = weights.size();
+   std::vector<double> scaled(n);
+   std::vector<uint32_t> small, large;
+   for (size_t i = 0; i < n; i++)
+   {
+      scaled[i] = weights[i]*n/total;
+      (scaled[i] < 1.0 ? small : large).push_back(uint32_t(i));
+   }
+
+   columns_.resize(n);
+   while (!small.empty() && !large.empty())
+   {
+      uint32_t short_column = small.back();
+      small.pop_back();
+      uint32_t over = large.back();
+
+      columns_[short_column].threshold =
+         uint32_t(ldexp(std::max(scaled[short_column], 0.0), 32));
+      columns_[short_column].alias = over;
+
+      scaled[over] -= 1.0 - scaled[short_column];
+      if (scaled[over] < 1.0)
+      {
+         large.pop_back();
+         small.push_back(over);
+      }
+   }
+
+   // What is left is full, up to rounding.
+   for (size_t i = 0; i < large.size(); i++)
+      columns_[large[i]].alias = large[i];
+   for (size_t i = 0; i < small.size(); i++)
+      columns_[small[i]].alias = small[i];
+}
+
+void AliasTable::Sample(const uint64_t* words, uint32_t* outcomes,
+   size_t count) const
+{
+   const Column* columns = &columns_[0];
+   uint64_t n = columns_.size();
+   for (size_t i = 0; i < count; i++)
+   {
+      uint32_t j = uint32_t(((words[i] >> 32)*n) >> 32);
+      uint32_t keep = 0 - uint32_t(uint32_t(words[i]) < columns[j].threshold);
+      outcomes[i] = (j & keep) | (columns[j].alias & ~keep);
+   }
+}
+
+namespace
+{
+   // SymbolTable is an AliasTable whose outcomes are the symbols of an
+   // alphabet.
+
+   class SymbolTable
+   {
+   public:
+
+      SymbolTable(const std::vector<double>& probabilities,
+         const std::string& alphabet)
+      {
+         if (probabilities.size() != alphabet.length())
+            throw std::exception(
+               "there must be one probability per symbol of the alphabet");
+         table_ = AliasTable(probabilities);
+         alphabet_ = alphabet;
+      }
+
+      // Generate sets output[i] to the symbol for words[i], for up to
+      // RANDOM_BATCH words.
+      void Generate(const uint64_t* words, char* output, size_t length) const
+      {
+         uint32_t outcomes[RANDOM_BATCH];
+         table_.Sample(words, outcomes, length);
+         const char* symbols = alphabet_.data();
+         for (size_t i = 0; i < length; i++)
+            output[i] = symbols[outcomes[i]];
+      }
+
+   private:
+
+      AliasTable table_;
+      std::string alphabet_;
+   };
+}
+
+/* static */ void EntropySource::GenerateMessage(RandomEngine& engine,
+   const std::vector<double>& probabilities, const std::string& alphabet,
+   size_t length, std::string& message)
+{
+   if (length == 0)
+      throw std::exception("length must be greater than zero");
+
+   SymbolTable table(probabilities, alphabet);
+
+   size_t start = message.length();
+   message.resize(start + length);
+   char* output = &message[start];
+
+   uint64_t words[RANDOM_BATCH];
+   for (size_t i = 0; i < length; i += RANDOM_BATCH)
+   {
+      size_t count = std::min(RANDOM_BATCH, length - i);
+      engine.Fill(words, count);
+      table.Generate(words, output + i, count);
+   }
+}
+
+/* static */ void EntropySource::GenerateMessage(uint64_t seed,
+   const std::vector<double>& probabilities, const std::string& alphabet,
+   size_t length, std::string& message, unsigned threads)
+{
+   if (length == 0)
+      throw std::exception("length must be greater than zero");
+
+   size_t start = message.length();
+   message.resize(start + length);
+   GenerateMessage(seed, probabilities, alphabet, 0, length, &message[start],
+      threads);
+}
+
+/* static */ void EntropySource::GenerateMessage(uint64_t seed,
+   const std::vector<double>& probabilities, const std::string& alphabet,
+   uint64_t position, size_t length, char* output, unsigned threads)
+{
+   if (length == 0)
+      throw std::exception("length must be greater than zero");
+
+   SymbolTable table(probabilities, alphabet);
+   threads = ChunkThreads(threads, length);
+
+   RunParallel(threads, [&](size_t thread)
+   {
+      size_t begin = length*thread/threads;
+      size_t end = length*(thread + 1)/threads;
+
+      Philox4x64 engine(seed);
+      engine.Seek(position + begin);
+
+      uint64_t words[RANDOM_BATCH];
+      for (size_t i = begin; i < end; i += RANDOM_BATCH)
+      {
+         size_t count = std::min(RANDOM_BATCH, end - i);
+         engine.Fill(words, count);
+         table.Generate(words, output + i, count);
+      }
+   });
+}
+
+namespace
+{
+   const int MAX_STATIONARY_STEPS = 100000;
+   const double STATIONARY_TOLERANCE = 1e-15;
+}
+
+MarkovSource::MarkovSource(
+   const std::vector<std::vector<double> >& transitions,
+   const std::vector<std::string>& symbols)
+   : transitions_(transitions)
+{
+   size_t states = transitions.size();
+   if (states == 0 || symbols.size() != states)
+      throw std::exception("there must be a row of symbols for each state");
+
+   for (size_t i = 0; i < states; i++)
+   {
+      if (transitions[i].size() != states || symbols[i].length() != states)
+         throw std::exception("the transitions must be a square matrix");
+
+      tables_.push_back(AliasTable(transitions[i]));
+      symbols_ += symbols[i];
+
+      double total = 0.0;
+      for (size_t j = 0; j < states; j++)
+         total += transitions[i][j];
+      for (size_t j = 0; j < states; j++)
+         transitions_[i][j] /= total;
+   }
+
+   // Step the lazy chain, which stays put half the time, from the uniform
+   // distribution.  It has the same stationary distribution, and converges
+   // to it even when the source is periodic.
+
+   stationary_.assign(states, 1.0/states);
+   std::vector<double> next(states);
+   for (int step = 0; step < MAX_STATIONARY_STEPS; step++)
+   {
+      for (size_t j = 0; j < states; j++)
+         next[j] = 0.5*stationary_[j];
+      for (size_t i = 0; i < states; i++)
+         for (size_t j = 0; j < states; j++)
+            next[j] += 0.5*stationary_[i]*transitions_[i][j];
+
+      double change = 0.0;
+      for (size_t j = 0; j < states; j++)
+         change += fabs(next[j] - stationary_[j]);
+      stationary_.swap(next);
+      if (change < STATIONARY_TOLERANCE)
+         break;
+   }
+}
+
+std::string MarkovSource::Symbols() const
+{
+   std::string symbols;
+   for (size_t i = 0; i < symbols_.length(); i++)
+      if (symbols.find(symbols_[i]) == std::string::npos)
+         symbols += symbols_[i];
+   return symbols;
+}
+
+double MarkovSource::EntropyRate() const
+{
+   double H = 0.0;
+   for (size_t i = 0; i < transitions_.size(); i++)
+   {
+      double H_i = 0.0;
+      for (size_t j = 0; j < transitions_.size(); j++)
+      {
+         double p = transitions_[i][j];
+         if (p > 0.0)
+            H_i -= p*log(p)/log(2.0);
+      }
+      H += stationary_[i]*H_i;
+   }
+   return H;
+}
+
+/* static */ void EntropySource::GenerateMessage(RandomEngine& engine,
+   const MarkovSource& source, size_t& state, size_t length,
+   std::string& message)
+{
+   if (length == 0)
+      throw std::exception("length must be greater than zero");
+   if (state >= source.States())
+      throw std::exception("state is out of range");
+
+   size_t start = message.length();
+   message.resize(start + length);
+   GenerateMessage(engine, source, state, length, &message[start]);
+}
+
+/* static */ void EntropySource::GenerateMessage(RandomEngine& engine,
+   const MarkovSource& source, size_t& state, size_t length, char* output)
+{
+   if (length == 0)
+      throw std::exception("length must be greater than zero");
+   if (state >= source.States())
+      throw std::exception("state is out of range");
+
+   // the state is a local so that the stores to output leave it in a
+   // register
+   size_t current = state;
+   uint64_t words[RANDOM_BATCH];
+   for (size_t i = 0; i < length; i += RANDOM_BATCH)
+   {
+      size_t count = std::min(RANDOM_BATCH, length - i);
+      engine.Fill(words, count);
+      for (size_t k = 0; k < count; k++)
+         output[i + k] = source.Next(current, words[k]);
+   }
+   state = current;
+}
+
+void BinaryProducer::Produce(char* output, size_t length)
+{
+   EntropySource::GenerateBinaryMessage(seed_, p_, position_, length, output,
+      threads_);
+   position_ += length;
+}
+
+void SymbolProducer::Produce(char* output, size_t length)
+{
+   EntropySource::GenerateMessage(seed_, probabilities_, alphabet_, position_,
+      length, output, threads_);
+   position_ += length;
+}
+
+void MarkovProducer::Produce(char* output, size_t length)
+{
+   EntropySource::GenerateMessage(engine_, source_, state_, length, output);
+}
+
+std::string MarkovProducer::Alphabet() const
+{
+   return source_.Symbols();
+}
+
+void* shannon1948::AllocateLarge(size_t bytes)
+{
+#if defined(_WIN32)
+   // Large pages need the "lock pages in memory" privilege, so fall back to
+   // normal pages if they cannot be had.
+   void* memory = 0;
+   size_t large_page = GetLargePageMinimum();
+   if (large_page != 0 && bytes % large_page == 0)
+      memory = VirtualAlloc(0, bytes,
+         MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+   if (memory == 0)
+      memory = VirtualAlloc(0, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+   if (memory == 0)
+      throw std::bad_alloc();
+   return memory;
+#elif defined(__unix__) || defined(__APPLE__)
+   void* memory = mmap(0, bytes, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (memory == MAP_FAILED)
+      throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+   madvise(memory, bytes, MADV_HUGEPAGE); // only a hint
+#endif
+   return memory;
+#else
+   return ::operator new(bytes);
+#endif
+}
+
+void shannon1948::FreeLarge(void* memory, size_t bytes)
+{
+#if defined(_WIN32)
+   (void)bytes;
+   VirtualFree(memory, 0, MEM_RELEASE);
+#elif defined(__unix__) || defined(__APPLE__)
+   munmap(memory, bytes);
+#else
+   (void)bytes;
+   ::operator delete(memory);
+#endif
+}
+
+MappedFile::MappedFile(const std::string& path)
+   : data_(0), length_(0)
+{
+#if defined(_WIN32)
+   HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, 0,
+      OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+   if (file == INVALID_HANDLE_VALUE)
+      throw std::exception("cannot open file");
+
+   LARGE_INTEGER size;
+   if (!GetFileSizeEx(file, &size) || uint64_t(size.QuadPart) > size_t(-1))
+   {
+      CloseHandle(file);
+      throw std::exception("cannot find the size of file");
+   }
+   length_ = size_t(size.QuadPart);
+
+   if (length_ != 0)
+   {
+      // the view keeps the file and mapping open once they are closed here
+      HANDLE mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+      if (mapping != 0)
+      {
+         data_ = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+         CloseHandle(mapping);
+      }
+   }
+   CloseHandle(file);
+#elif defined(__unix__) || defined(__APPLE__)
+   int file = open(path.c_str(), O_RDONLY);
+   if (file == -1)
+      throw std::exception("cannot open file");
+
+   struct stat status;
+   if (fstat(file, &status) != 0 || uint64_t(status.st_size) > size_t(-1))
+   {
+      close(file);
+      throw std::exception("cannot find the size of file");
+   }
+   length_ = size_t(status.st_size);
+
+   if (length_ != 0)
+   {
+      data_ = mmap(0, length_, PROT_READ, MAP_SHARED, file, 0);
+      if (data_ == MAP_FAILED)
+         data_ = 0;
+      else
+         madvise(data_, length_, MADV_SEQUENTIAL);
+   }
+   close(file);
+#else
+   (void)path;
+   throw std::exception("memory mapped files are not supported");
+#endif
+
+   if (length_ != 0 && data_ == 0)
+      throw std::exception("cannot map file into memory");
+}
+
+MappedFile::~MappedFile()
+{
+   if (data_ == 0)
+      return;
+#if defined(_WIN32)
+   UnmapViewOfFile(data_);
+#elif defined(__unix__) || defined(__APPLE__)
+   munmap(data_, length_);
+#endif
+}
+
+OutputFile::OutputFile(const std::string& path, uint64_t length)
+   : length_(length), mapping_(0), file_(-1), view_(0), view_length_(0)
+{
+#if defined(_WIN32)
+   HANDLE file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, 0,
+      CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+   if (file == INVALID_HANDLE_VALUE)
+      throw std::exception("cannot create file");
+
+   if (length_ != 0)
+   {
+      // the mapping sets the size of the file, and keeps it open
+      mapping_ = CreateFileMappingA(file, 0, PAGE_READWRITE,
+         DWORD(length >> 32), DWORD(length), 0);
+   }
+   CloseHandle(file);
+
+   if (length_ != 0 && mapping_ == 0)
+      throw std::exception("cannot set the size of file");
+#elif defined(__unix__) || defined(__APPLE__)
+   file_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+   if (file_ == -1)
+      throw std::exception("cannot create file");
+
+   if (uint64_t(off_t(length)) != length ||
+      ftruncate(file_, off_t(length)) != 0)
+   {
+      close(file_);
+      throw std::exception("cannot set the size of file");
+   }
+#else
+   (void)path;
+   throw std::exception("memory mapped files are not supported");
+#endif
+}
+
+OutputFile::~OutputFile()
+{
+   Unmap();
+#if defined(_WIN32)
+   if (mapping_ != 0)
+      CloseHandle(mapping_);
+#elif defined(__unix__) || defined(__APPLE__)
+   close(file_);
+#endif
+}
+
+char* OutputFile::Map(uint64_t offset, size_t length)
+{
+   Unmap();
+   if (offset > length_ || length > length_ - offset)
+      throw std::exception("window is outside the file");
+   if (length == 0)
+      return 0;
+
+   // views must begin on a boundary of the system's choosing
+#if defined(_WIN32)
+   SYSTEM_INFO system;
+   GetSystemInfo(&system);
+   uint64_t boundary = system.dwAllocationGranularity;
+#elif defined(__unix__) || defined(__APPLE__)
+   uint64_t boundary = uint64_t(sysconf(_SC_PAGESIZE));
+#else
+   uint64_t boundary = 1;
+#endif
+   uint64_t begin = offset/boundary*boundary;
+   if (offset + length - begin > size_t(-1))
+      throw std::exception("window is too large to map into memory");
+   size_t view_length = size_t(offset + length - begin);
+
+#if defined(_WIN32)
+   view_ = MapViewOfFile(mapping_, FILE_MAP_WRITE,
+      DWORD(begin >> 32), DWORD(begin), view_length);
+#elif defined(__unix__) || defined(__APPLE__)
+   view_ = mmap(0, view_length, PROT_READ | PROT_WRITE, MAP_SHARED, file_,
+      off_t(begin));
+   if (view_ == MAP_FAILED)
+      view_ = 0;
+#endif
+
+   if (view_ == 0)
+      throw std::exception("cannot map file into memory");
+   view_length_ = view_length;
+   return static_cast<char*>(view_) + size_t(offset - begin);
+}
+
+void OutputFile::Unmap()
+{
+   if (view_ == 0)
+      return;
+
+   // the written pages stay in the page cache to be written back, so
+   // unmapping them loses nothing
+#if defined(_WIN32)
+   UnmapViewOfFile(view_);
+#elif defined(__unix__) || defined(__APPLE__)
+   msync(view_, view_length_, MS_ASYNC);
+   munmap(view_, view_length_);
+#endif
+   view_ = 0;
+   view_length_ = 0;
+}
+
+namespace
+{
+   const char TEXT_MODEL_MAGIC[8] = { 'S', 'H', '1', '9', '4', '8', 'T', 'M' };
+   const size_t TRAINING_BLOCK = 1 << 20;
+
+   struct KeyCount
+   {
+      uint64_t key;
+      uint64_t count;
+   };
+
+   // AddKeys counts keys, which are in no order, into counts, which are
+   // sorted by key, and empties keys.
+   void AddKeys(std::vector<uint64_t>& keys, std::vector<KeyCount>& counts)
+   {
+      std::sort(keys.begin(), keys.end());
+
+      std::vector<KeyCount> merged;
+      merged.reserve(counts.size() + keys.size());
+      size_t i = 0;
+      for (size_t k = 0; k < keys.size(); )
+      {
+         KeyCount next = { keys[k], 0 };
+         for (; k < keys.size() && keys[k] == next.key; k++)
+            ++next.count;
+
+         for (; i < counts.size() && counts[i].key < next.key; i++)
+            merged.push_back(counts[i]);
+         if (i < counts.size() && counts[i].key == next.key)
+            next.count += counts[i++].count;
+         merged.push_back(next);
+      }
+      merged.insert(merged.end(), counts.begin() + i, counts.end());
+
+      counts.swap(merged);
+      keys.clear();
+   }
+
+   // MergeCounts adds the sorted counts of from into the sorted counts of
+   // to.
+   void MergeCounts(const std::vector<KeyCount>& from,
+      std::vector<KeyCount>& to)
+   {
+      std::vector<KeyCount> merged;
+      merged.reserve(from.size() + to.size());
+      size_t i = 0, j = 0;
+      while (i < from.size() || j < to.size())
+      {
+         if (j == to.size() || (i < from.size() && from[i].key < to[j].key))
+            merged.push_back(from[i++]);
+         else if (i == from.size() || to[j].key < from[i].key)
+            merged.push_back(to[j++]);
+         else
+         {
+            KeyCount sum = { from[i].key, from[i].count + to[j].count };
+            merged.push_back(sum);
+            i++;
+            j++;
+         }
+      }
+      to.swap(merged);
+   }
+
+   // CountNGrams counts the N-grams of the units unit(0) to unit(length-1),
+   // each of bits bits, as keys with the first unit in the high bits, so
+   // that keys sort as their N-grams do.
+   template <typename Unit>
+   std::vector<KeyCount> CountNGrams(Unit unit, size_t length, size_t N,
+      unsigned bits, unsigned threads)
+   {
+      std::vector<KeyCount> counts;
+      if (length < N)
+         return counts;
+
+      size_t starts = length - N + 1;
+      threads = ChunkThreads(threads, starts);
+      std::vector<std::vector<KeyCount> > thread_counts(threads);
+
+      RunParallel(threads, [&](size_t thread)
+      {
+         size_t begin = starts*thread/threads;
+         size_t end = starts*(thread + 1)/threads;
+
+         std::vector<uint64_t> keys;
+         keys.reserve(std::min(TRAINING_BLOCK, end - begin));
+         uint64_t key = 0;
+         for (size_t i = begin; i < begin + N - 1; i++)
+            key = (key << bits) | unit(i);
+         for (size_t i = begin; i < end; i++)
+         {
+            key = (N*bits == 64 ? key << bits :
+               (key << bits) & ((uint64_t(1) << (N*bits)) - 1)) |
+               unit(i + N - 1);
+            keys.push_back(key);
+            if (keys.size() == TRAINING_BLOCK)
+               AddKeys(keys, thread_counts[thread]);
+         }
+         AddKeys(keys, thread_counts[thread]);
+      });
+
+      for (size_t thread = 0; thread < threads; thread++)
+         MergeCounts(thread_counts[thread], counts);
+      return counts;
+   }
+
+   inline bool IsSpace(char c)
+   {
+      return c == ' ' || (c >= '\t' && c <= '\r');
+   }
+
+   struct Word
+   {
+      const char* data;
+      size_t length;
+
+      bool operator<(const Word& other) const
+      {
+         int order = memcmp(data, other.data, std::min(length, other.length));
+         return order < 0 || (order == 0 && length < other.length);
+      }
+
+      bool operator==(const Word& other) const
+      {
+         return length == other.length &&
+            memcmp(data, other.data, length) == 0;
+      }
+   };
+
+   // SortedWords sorts words and removes repeats.
+   void SortedWords(std::vector<Word>& words)
+   {
+      std::sort(words.begin(), words.end());
+      words.erase(std::unique(words.begin(), words.end()), words.end());
+   }
+
+   inline size_t Aligned(size_t bytes)
+   {
+      return (bytes + 7)/8*8;
+   }
+}
+
+const uint32_t TextModel::NO_CONTEXT;
+
+// Header begins a model image, followed by each array in the order of the
+// members of TextModel, each padded to a multiple of eight bytes.
+
+struct TextModel::Header
+{
+   char magic[8];
+   uint64_t unit;
+   uint64_t N;
+   uint64_t bits;
+   uint64_t contexts;
+   uint64_t ngrams;
+   uint64_t words;
+   uint64_t word_bytes;
+};
+
+TextModel::TextModel(const void* corpus, size_t length, Unit unit, size_t N,
+   unsigned threads)
+   : file_(0)
+{
+   if (N == 0)
+      throw std::exception("N must be greater than zero");
+
+   const char* text = (const char*)corpus;
+   std::vector<Word> vocabulary;
+   std::vector<uint32_t> tokens;
+   std::vector<KeyCount> counts;
+   unsigned bits = 8;
+
+   if (unit == LETTERS)
+   {
+      if (!Packable(N, bits))
+         throw std::exception("N must be at most 8 for letters");
+      counts = CountNGrams([text](size_t i) { return (unsigned char)text[i]; },
+         length, N, bits, threads);
+   }
+   else
+   {
+      // Each thread takes the words that start in its part of the corpus and
+      // sorts them.  The sorted words of all the threads make the
+      // vocabulary, and each word is then numbered by its place in it.
+
+      threads = ChunkThreads(threads, length);
+      std::vector<std::vector<Word> > words(threads), sorted(threads);
+      RunParallel(threads, [&](size_t thread)
+      {
+         size_t begin = length*thread/threads;
+         size_t end = length*(thread + 1)/threads;
+         for (size_t i = begin; i < end; i++)
+         {
+            if (IsSpace(text[i]) || (i != 0 && !IsSpace(text[i - 1])))
+               continue;
+            size_t j = i;
+            while (j < length && !IsSpace(text[j]))
+               j++;
+            Word word = { text + i, j - i };
+            words[thread].push_back(word);
+         }
+         sorted[thread] = words[thread];
+         SortedWords(sorted[thread]);
+      });
+
+      for (size_t thread = 0; thread < threads; thread++)
+      {
+         vocabulary.insert(vocabulary.end(), sorted[thread].begin(),
+            sorted[thread].end());
+         std::vector<Word>().swap(sorted[thread]);
+      }
+      SortedWords(vocabulary);
+      if (uint64_t(vocabulary.size()) >= NO_CONTEXT)
+         throw std::exception("there are too many distinct words");
+
+      bits = std::max(SymbolBits(vocabulary.size()), 1u);
+      if (!Packable(N, bits))
+         throw std::exception("N is too large for the number of words");
+
+      std::vector<size_t> offsets(threads + 1);
+      for (size_t thread = 0; thread < threads; thread++)
+         offsets[thread + 1] = offsets[thread] + words[thread].size();
+      tokens.resize(offsets[threads]);
+      RunParallel(threads, [&](size_t thread)
+      {
+         for (size_t i = 0; i < words[thread].size(); i++)
+            tokens[offsets[thread] + i] = uint32_t(std::lower_bound(
+               vocabulary.begin(), vocabulary.end(), words[thread][i]) -
+               vocabulary.begin());
+      });
+
+      const uint32_t* units = tokens.empty() ? 0 : &tokens[0];
+      counts = CountNGrams([units](size_t i) { return units[i]; },
+         tokens.size(), N, bits, threads);
+   }
+
+   if (counts.empty())
+      throw std::exception("the corpus is shorter than N units");
+   if (uint64_t(counts.size()) >= NO_CONTEXT)
+      throw std::exception("there are too many distinct N-grams");
+
+   // The context of an N-gram is its first N-1 units, and the context it
+   // leads to is its last N-1.
+
+   uint64_t unit_mask = (uint64_t(1) << bits) - 1;
+   uint64_t suffix_mask = (uint64_t(1) << ((N - 1)*bits)) - 1;
+   std::vector<uint64_t> contexts;
+   std::vector<uint64_t> begins;
+   for (size_t i = 0; i < counts.size(); i++)
+   {
+      uint64_t context = counts[i].key >> bits;
+      if (contexts.empty() || contexts.back() != context)
+      {
+         contexts.push_back(context);
+         begins.push_back(i);
+      }
+   }
+   begins.push_back(counts.size());
+
+   size_t word_bytes = 0;
+   for (size_t i = 0; i < vocabulary.size(); i++)
+      word_bytes += vocabulary[i].length;
+
+   Header header;
+   memcpy(header.magic, TEXT_MODEL_MAGIC, sizeof(header.magic));
+   header.unit = unit;
+   header.N = N;
+   header.bits = bits;
+   header.contexts = contexts.size();
+   header.ngrams = counts.size();
+   header.words = vocabulary.size();
+   header.word_bytes = word_bytes;
+
+   size_t C = contexts.size(), G = counts.size();
+   size_t bytes = sizeof(Header) + 8*(C + 1) + 8*C +
+      Aligned(sizeof(Column)*G) + 8*(vocabulary.size() + 1) +
+      Aligned(word_bytes);
+   image_.resize(bytes/8);
+   char* data = (char*)&image_[0];
+   memcpy(data, &header, sizeof(header));
+   Attach(data, bytes);
+
+   uint64_t* begin = const_cast<uint64_t*>(begin_);
+   StartColumn* start = const_cast<StartColumn*>(start_);
+   Column* columns = const_cast<Column*>(columns_);
+   uint64_t* word_begin = const_cast<uint64_t*>(word_begin_);
+   char* words = const_cast<char*>(words_);
+
+   std::vector<uint32_t> units(G), next(G);
+   for (size_t i = 0; i < G; i++)
+   {
+      units[i] = uint32_t(counts[i].key & unit_mask);
+      uint64_t suffix = counts[i].key & suffix_mask;
+      std::vector<uint64_t>::const_iterator found =
+         std::lower_bound(contexts.begin(), contexts.end(), suffix);
+      next[i] = found != contexts.end() && *found == suffix ?
+         uint32_t(found - contexts.begin()) : NO_CONTEXT;
+   }
+
+   std::vector<double> totals(C);
+   for (size_t c = 0; c < C; c++)
+   {
+      begin[c] = begins[c];
+
+      std::vector<double> weights;
+      for (size_t i = begins[c]; i < begins[c + 1]; i++)
+      {
+         weights.push_back(double(counts[i].count));
+         totals[c] += double(counts[i].count);
+      }
+
+      AliasTable table(weights);
+      for (size_t j = 0; j < table.Size(); j++)
+      {
+         Column& column = columns[begins[c] + j];
+         size_t alias = begins[c] + table.Alias(j);
+         column.threshold = table.Threshold(j);
+         column.unit[0] = units[begins[c] + j];
+         column.next[0] = next[begins[c] + j];
+         column.unit[1] = units[alias];
+         column.next[1] = next[alias];
+      }
+   }
+   begin[C] = G;
+
+   AliasTable table(totals);
+   for (size_t c = 0; c < C; c++)
+   {
+      start[c].threshold = table.Threshold(c);
+      start[c].alias = table.Alias(c);
+   }
+
+   word_begin[0] = 0;
+   for (size_t i = 0; i < vocabulary.size(); i++)
+   {
+      memcpy(words + word_begin[i], vocabulary[i].data, vocabulary[i].length);
+      word_begin[i + 1] = word_begin[i] + vocabulary[i].length;
+   }
+}
+
+TextModel::TextModel(const std::string& path)
+   : file_(new MappedFile(path))
+{
+   try
+   {
+      Attach(file_->Data(), file_->Length());
+   }
+   catch (...)
+   {
+      delete file_;
+      throw;
+   }
+}
+
+TextModel::~TextModel()
+{
+   delete file_;
+}
+
+void TextModel::Attach(const char* data, size_t length)
+{
+   if (length < sizeof(Header) ||
+      memcmp(data, TEXT_MODEL_MAGIC, sizeof(TEXT_MODEL_MAGIC)) != 0)
+      throw std::exception("not a text model");
+
+   header_ = (const Header*)data;
+   uint64_t C = header_->contexts, G = header_->ngrams;
+   uint64_t words = header_->words, word_bytes = header_->word_bytes;
+   if (C == 0 || C > length || G > length || words > length ||
+      word_bytes > length)
+      throw std::exception("the text model is damaged");
+
+   const char* p = data + sizeof(Header);
+   begin_ = (const uint64_t*)p;
+   p += 8*(C + 1);
+   start_ = (const StartColumn*)p;
+   p += 8*C;
+   columns_ = (const Column*)p;
+   p += Aligned(size_t(sizeof(Column)*G));
+   word_begin_ = (const uint64_t*)p;
+   p += 8*(words + 1);
+   words_ = p;
+   p += Aligned(size_t(word_bytes));
+
+   if (size_t(p - data) != length)
+      throw std::exception("the text model is damaged");
+}
+
+void TextModel::Save(const std::string& path) const
+{
+   const char* data = (const char*)header_;
+   size_t length = file_ != 0 ? file_->Length() : 8*image_.size();
+
+   FILE* file = fopen(path.c_str(), "wb");
+   if (file == 0)
+      throw std::exception("cannot create file");
+   bool written = fwrite(data, 1, length, file) == length;
+   if (fclose(file) != 0 || !written)
+      throw std::exception("cannot write file");
+}
+
+TextModel::Unit TextModel::GetUnit() const
+{
+   return Unit(header_->unit);
+}
+
+size_t TextModel::N() const
+{
+   return size_t(header_->N);
+}
+
+size_t TextModel::Contexts() const
+{
+   return size_t(header_->contexts);
+}
+
+size_t TextModel::NGrams() const
+{
+   return size_t(header_->ngrams);
+}
+
+void TextModel::AppendUnit(uint32_t unit, std::string& output) const
+{
+   if (header_->unit == LETTERS)
+      output += char(unit);
+   else
+      output.append(words_ + word_begin_[unit],
+         size_t(word_begin_[unit + 1] - word_begin_[unit]));
+}
+
+/* static */ void EntropySource::GenerateText(RandomEngine& engine,
+   const TextModel& model, size_t length, std::string& output)
+{
+   if (length == 0)
+      throw std::exception("length must be greater than zero");
+
+   RandomWords random(engine);
+   uint32_t context = model.Start(random.Next());
+
+   if (model.GetUnit() == TextModel::LETTERS)
+   {
+      size_t start = output.length();
+      output.resize(start + length);
+      char* letters = &output[start];
+      for (size_t i = 0; i < length; i++)
+      {
+         letters[i] = char(model.Next(context, random.Next()));
+         if (context == TextModel::NO_CONTEXT)
+            context = model.Start(random.Next());
+      }
+      return;
+   }
+
+   for (size_t i = 0; i < length; i++)
+   {
+      if (i != 0)
+         output += ' ';
+      model.AppendUnit(model.Next(context, random.Next()), output);
+      if (context == TextModel::NO_CONTEXT)
+         context = model.Start(random.Next());
+   }
+}
+
+NGramCounter::NGramCounter(
+   size_t N, const std::string& alphabet, uint64_t expected_samples)
+   : N_(N), alphabet_(alphabet), bits_(0), storage_(DENSE), samples_(0),
+   key_(0), mask_(0), filled_(0), used_(0), history_length_(0), hash_(0),
+   hash_power_(1)
+{
+   if (N == 0)
+      throw std::exception("N must be greater than zero");
+
+   // assign codes in alphabet order, so that the order of packed keys is the
+   // lexicographic order of the N-grams
+
+   size_t symbols = 0;
+   if (alphabet.empty())
+   {
+      for (int c = 0; c < 256; c++)
+      {
+         codes_[c] = uint16_t(c);
+         symbols_[c] = (unsigned char)c;
+      }
+      symbols = 256;
+   }
+   else
+   {
+      for (int c = 0; c < 256; c++)
+         codes_[c] = NO_CODE;
+      for (size_t i = 0; i < alphabet.length(); i++)
+      {
+         unsigned char symbol = (unsigned char)alphabet[i];
+         if (codes_[symbol] == NO_CODE)
+         {
+            symbols_[symbols] = symbol;
+            codes_[symbol] = uint16_t(symbols++);
+         }
+      }
+   }
+
+   bits_ = SymbolBits(symbols);
+
+   if (!Packable(N, bits_))
+   {
+      storage_ = WIDE;
+      wide_.resize(INITIAL_TABLE_SIZE);
+      history_.resize(N + HISTORY_SIZE);
+      for (size_t i = 1; i < N; i++)
+         hash_power_ *= ROLLING_PRIME;
+      return;
+   }
+
+   unsigned key_bits = unsigned(N*bits_);
+   mask_ = key_bits == 64 ? ~uint64_t(0) : (uint64_t(1) << key_bits) - 1;
+
+   if (key_bits <= DENSE_BITS || (key_bits <= MAX_DENSE_BITS &&
+      (uint64_t(1) << key_bits) <= 2*expected_samples))
+   {
+      dense_.resize(size_t(1) << key_bits);
+   }
+   else
+   {
+      storage_ = HASHED;
+      hashed_.resize(INITIAL_TABLE_SIZE);
+   }
+}
+
+inline unsigned NGramCounter::Code(unsigned char symbol) const
+{
+   unsigned code = codes_[symbol];
+   if (code == NO_CODE)
+      throw std::exception("symbol is not in the alphabet");
+   return code;
+}
+
+void NGramCounter::Update(const void* data, size_t length)
+{
+   if (storage_ == WIDE)
+      UpdateWide((const unsigned char*)data, length);
+   else
+      UpdatePacked((const unsigned char*)data, length);
+}
+
+void NGramCounter::UpdatePacked(const unsigned char* data, size_t length)
+{
+   uint64_t key = key_;
+   size_t i = 0;
+
+   // the first N-1 symbols of the message only start the first N-gram
+
+   for (; filled_ + 1 < N_ && i < length; i++, filled_++)
+      key = (key << bits_) | Code(data[i]);
+
+   samples_ += length - i;
+
+   if (storage_ == DENSE && bits_ == 1)
+   {
+      key = CountBinary(data + i, length - i, key);
+   }
+   else if (storage_ == DENSE)
+   {
+      uint32_t* counts = &dense_[0];
+      for (; i < length; i++)
+      {
+         key = ((key << bits_) | Code(data[i])) & mask_;
+         if (++counts[key] == 0)
+            ++dense_overflow_[key];
+      }
+   }
+   else
+   {
+      for (; i < length; i++)
+      {
+         key = ((key << bits_) | Code(data[i])) & mask_;
+         IncrementHashed(key);
+      }
+   }
+
+   key_ = key;
+}
+
+void NGramCounter::Update(const void* data, size_t length, unsigned threads)
+{
+   const unsigned char* symbols = (const unsigned char*)data;
+
+   // The N-grams that end in the first N-1 symbols continue this counter's
+   // message, so they are counted here.  Each chunk after that starts N-1
+   // symbols early, so that its first N-gram ends at its first new symbol.
+
+   size_t head = std::min(N_ - 1, length);
+   Update(symbols, head);
+
+   threads = ChunkThreads(threads, length - head);
+   if (threads == 1)
+   {
+      Update(symbols + head, length - head);
+      return;
+   }
+
+   std::vector<NGramCounter> chunks;
+   chunks.reserve(threads);
+   for (unsigned i = 0; i < threads; i++)
+      chunks.push_back(NGramCounter(N_, alphabet_, (length - head)/threads));
+
+   Update(symbols + head, length - head, chunks);
+   MergeWorkers(chunks);
+   Restart(symbols + length - (N_ - 1), N_ - 1);
+}
+
+void NGramCounter::Update(const void* data, size_t length,
+   std::vector<NGramCounter>& workers)
+{
+   const unsigned char* symbols = (const unsigned char*)data;
+
+   size_t head = std::min(N_ - 1, length);
+   Update(symbols, head);
+
+   unsigned threads = ChunkThreads(unsigned(workers.size()), length - head);
+   if (threads == 1)
+   {
+      Update(symbols + head, length - head);
+      return;
+   }
+
+   // each worker forgets the end of its last chunk and starts on the N-1
+   // symbols before its new one
+   RunParallel(threads, [&](size_t i)
+   {
+      size_t begin = head + (length - head)*i/threads;
+      size_t end = head + (length - head)*(i + 1)/threads;
+      workers[i].Restart(symbols + begin - (N_ - 1), N_ - 1);
+      workers[i].Update(symbols + begin, end - begin);
+   });
+
+   Restart(symbols + length - (N_ - 1), N_ - 1);
+}
+
+void NGramCounter::MergeWorkers(std::vector<NGramCounter>& workers)
+{
+   // tree reduction: merge pairs of workers in parallel until one is left
+
+   for (size_t step = 1; step < workers.size(); step *= 2)
+   {
+      size_t pairs = (workers.size() - step + 2*step - 1)/(2*step);
+      RunParallel(pairs, [&](size_t i)
+      {
+         workers[2*step*i].Merge(workers[2*step*i + step]);
+      });
+   }
+
+   if (!workers.empty())
+      Merge(workers[0]);
+}
+
+inline void NGramCounter::CountKey(uint64_t key)
+{
+   if (storage_ == DENSE)
+   {
+      if (++dense_[size_t(key)] == 0)
+         ++dense_overflow_[key];
+   }
+   else
+   {
+      IncrementHashed(key);
+   }
+}
+
+void NGramCounter::UpdateBits(const void* data, size_t length)
+{
+   CountBits((const unsigned char*)data, length, 0);
+}
+
+void NGramCounter::UpdateBits(
+   const void* data, size_t length, unsigned threads)
+{
+   const unsigned char* bytes = (const unsigned char*)data;
+
+   // As for Update with threads, but each chunk starts N-1 bits early,
+   // which may be part way into a byte.
+
+   size_t head = std::min((N_ - 1 + 7)/8, length);
+   CountBits(bytes, head, 0);
+
+   threads = ChunkThreads(threads, length - head);
+   if (threads == 1)
+   {
+      CountBits(bytes + head, length - head, 0);
+      return;
+   }
+
+   std::vector<NGramCounter> chunks;
+   chunks.reserve(threads);
+   for (unsigned i = 0; i < threads; i++)
+      chunks.push_back(NGramCounter(N_, alphabet_, 8*(length - head)/threads));
+
+   RunParallel(threads, [&](size_t i)
+   {
+      size_t begin = head + (length - head)*i/threads;
+      size_t end = head + (length - head)*(i + 1)/threads;
+      size_t first_bit = 8*begin - (N_ - 1);
+      chunks[i].CountBits(bytes + first_bit/8,
+         end - first_bit/8, unsigned(first_bit % 8));
+   });
+
+   for (size_t step = 1; step < chunks.size(); step *= 2)
+   {
+      size_t pairs = (chunks.size() - step + 2*step - 1)/(2*step);
+      RunParallel(pairs, [&](size_t i)
+      {
+         chunks[2*step*i].Merge(chunks[2*step*i + step]);
+      });
+   }
+
+   Merge(chunks[0]);
+
+   // carry on from the last N-1 bits
+   key_ = 0;
+   filled_ = 0;
+   size_t first_bit = 8*length - (N_ - 1);
+   CountBits(bytes + first_bit/8, length - first_bit/8,
+      unsigned(first_bit % 8));
+}
+
+void NGramCounter::CountBits(
+   const unsigned char* data, size_t length, unsigned skip)
+{
+   // skip is the number of leading bits of the first byte to leave out
+
+   if (bits_ != 1 || storage_ == WIDE)
+      throw std::exception("bits need a two-symbol alphabet and N <= 64");
+
+   uint64_t key = key_;
+   size_t i = 0;
+   unsigned bit = skip; // the next bit of data[i], from the most significant
+
+   // the first N-1 bits of the message only start the first N-gram
+
+   while (filled_ + 1 < N_ && i < length)
+   {
+      key = (key << 1) | ((data[i] >> (7 - bit)) & 1);
+      ++filled_;
+      if (++bit == 8)
+      {
+         bit = 0;
+         ++i;
+      }
+   }
+
+   // finish a partly used byte, then take 64 bits at a time
+
+   for (; bit != 0 && i < length; bit = (bit + 1) % 8)
+   {
+      key = ((key << 1) | ((data[i] >> (7 - bit)) & 1)) & mask_;
+      CountKey(key);
+      ++samples_;
+      if (bit == 7)
+         ++i;
+   }
+
+   for (; i + 8 <= length; i += 8)
+   {
+      uint64_t word = 0;
+      for (unsigned j = 0; j < 8; j++)
+         word = (word << 8) | data[i + j];
+
+      for (unsigned j = 0; j < 64; j++, word <<= 1)
+      {
+         key = ((key << 1) | (word >> 63)) & mask_;
+         CountKey(key);
+      }
+      samples_ += 64;
+   }
+
+   for (; i < length; i++)
+   {
+      for (int j = 7; j >= 0; j--)
+      {
+         key = ((key << 1) | ((data[i] >> j) & 1)) & mask_;
+         CountKey(key);
+      }
+      samples_ += 8;
+   }
+
+   key_ = key;
+}
+
+void NGramCounter::Restart(const unsigned char* tail, size_t length)
+{
+   // forget the symbols seen so far, then take in the tail of the message,
+   // which is too short to contain an N-gram
+   key_ = 0;
+   hash_ = 0;
+   filled_ = 0;
+   history_length_ = 0;
+   Update(tail, length);
+}
+
+void NGramCounter::Merge(const NGramCounter& other)
+{
+   if (other.N_ != N_ || memcmp(other.codes_, codes_, sizeof(codes_)) != 0)
+      throw std::exception("counters must count the same N-grams");
+
+   if (storage_ == DENSE && other.storage_ == DENSE)
+   {
+      MergeDense(other);
+   }
+   else if (storage_ == WIDE)
+   {
+      for (size_t i = 0; i < other.wide_.size(); i++)
+      {
+         const WideSlot& slot = other.wide_[i];
+         if (slot.count != 0)
+            IncrementWide(slot.hash,
+               &other.wide_keys_[size_t(slot.offset)], slot.count);
+      }
+   }
+   else if (other.storage_ == DENSE)
+   {
+      for (size_t key = 0; key < other.dense_.size(); key++)
+         if (other.dense_[key] != 0)
+            AddPacked(key, other.dense_[key]);
+      for (auto it = other.dense_overflow_.begin();
+         it != other.dense_overflow_.end(); it++)
+      {
+         AddPacked(it->first, it->second << 32);
+      }
+   }
+   else
+   {
+      for (size_t i = 0; i < other.hashed_.size(); i++)
+         if (other.hashed_[i].count != 0)
+            AddPacked(other.hashed_[i].key, other.hashed_[i].count);
+   }
+
+   samples_ += other.samples_;
+}
+
+void NGramCounter::MergeDense(const NGramCounter& other)
+{
+   uint32_t* counts = &dense_[0];
+   const uint32_t* other_counts = &other.dense_[0];
+   size_t size = dense_.size();
+   size_t i = 0;
+
+#ifdef SHANNON1948_SSE2
+   // Add four counters at a time.  SSE2 has no unsigned compare, so carries
+   // are found by flipping the sign bits and comparing as signed.
+
+   const __m128i sign = _mm_set1_epi32(int(0x80000000));
+
+   for (; i + 4 <= size; i += 4)
+   {
+      __m128i a = _mm_loadu_si128((const __m128i*)(counts + i));
+      __m128i b = _mm_loadu_si128((const __m128i*)(other_counts + i));
+      __m128i sum = _mm_add_epi32(a, b);
+      _mm_storeu_si128((__m128i*)(counts + i), sum);
+
+      int carries = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(
+         _mm_xor_si128(sum, sign), _mm_xor_si128(a, sign))));
+      for (unsigned j = 0; carries != 0; j++, carries >>= 1)
+         if (carries & 1)
+            ++dense_overflow_[i + j];
+   }
+#endif
+
+   for (; i < size; i++)
+   {
+      uint32_t a = counts[i];
+      counts[i] += other_counts[i];
+      if (counts[i] < a)
+         ++dense_overflow_[i];
+   }
+
+   for (auto it = other.dense_overflow_.begin();
+      it != other.dense_overflow_.end(); it++)
+   {
+      dense_overflow_[it->first] += it->second;
+   }
+}
+
+void NGramCounter::AddPacked(uint64_t key, uint64_t count)
+{
+   if (storage_ == HASHED)
+   {
+      IncrementHashed(key, count);
+      return;
+   }
+
+   uint64_t sum = dense_[size_t(key)] + (count & 0xFFFFFFFF);
+   dense_[size_t(key)] = uint32_t(sum);
+   uint64_t wraps = (count >> 32) + (sum >> 32);
+   if (wraps != 0)
+      dense_overflow_[key] += wraps;
+}
+
+NGramCounter NGramCounter::Marginal(size_t n) const
+{
+   if (n == 0 || n >= N_)
+      throw std::exception("n must be between 1 and N-1");
+
+   NGramCounter marginal(n, alphabet_, samples_);
+   unsigned shift = unsigned(bits_*(N_ - n));
+
+   if (storage_ == DENSE)
+   {
+      for (size_t key = 0; key < dense_.size(); key++)
+         if (dense_[key] != 0)
+            marginal.AddPacked(key >> shift, dense_[key]);
+      for (auto it = dense_overflow_.begin(); it != dense_overflow_.end(); it++)
+         marginal.AddPacked(it->first >> shift, it->second << 32);
+   }
+   else if (storage_ == HASHED)
+   {
+      for (size_t i = 0; i < hashed_.size(); i++)
+         if (hashed_[i].count != 0)
+            marginal.AddPacked(hashed_[i].key >> shift, hashed_[i].count);
+   }
+   else
+   {
+      for (size_t i = 0; i < wide_.size(); i++)
+         if (wide_[i].count != 0)
+            marginal.AddCodes(
+               &wide_keys_[size_t(wide_[i].offset)], wide_[i].count);
+   }
+
+   marginal.samples_ = samples_;
+
+   // the n-grams that start in the last N-1 symbols do not begin an N-gram
+
+   std::vector<unsigned char> tail;
+   Tail(tail);
+   for (size_t i = 0; i + n <= tail.size(); i++)
+   {
+      marginal.AddCodes(&tail[i], 1);
+      ++marginal.samples_;
+   }
+
+   // carry on from the end of the message
+
+   std::string symbols;
+   for (size_t i = tail.size() - std::min(tail.size(), n - 1);
+      i < tail.size(); i++)
+   {
+      symbols.push_back(char(symbols_[tail[i]]));
+   }
+   marginal.Restart((const unsigned char*)symbols.data(), symbols.length());
+
+   return marginal;
+}
+
+void NGramCounter::Tail(std::vector<unsigned char>& codes) const
+{
+   // the codes of the last N-1 symbols, or all of them in a shorter message
+
+   size_t length = std::min(filled_, N_ - 1);
+   codes.resize(length);
+
+   if (storage_ == WIDE)
+   {
+      for (size_t i = 0; i < length; i++)
+         codes[i] = history_[history_length_ - length + i];
+      return;
+   }
+
+   uint64_t code_mask = (uint64_t(1) << bits_) - 1;
+   for (size_t i = 0; i < length; i++)
+   {
+      unsigned shift = unsigned(bits_*(length - 1 - i));
+      codes[i] = (unsigned char)((key_ >> shift) & code_mask);
+   }
+}
+
+void NGramCounter::AddCodes(const unsigned char* codes, uint64_t count)
+{
+   if (storage_ == WIDE)
+   {
+      IncrementWide(RollingHash(codes, N_), codes, count);
+      return;
+   }
+
+   uint64_t key = 0;
+   for (size_t i = 0; i < N_; i++)
+      key = (key << bits_) | codes[i];
+   AddPacked(key, count);
+}
+
+uint64_t NGramCounter::CountBinary(
+   const unsigned char* data, size_t length, uint64_t key)
+{
+   uint32_t* counts = &dense_[0];
+   size_t i = 0;
+
+#ifdef SHANNON1948_SSE2
+   // Classify 32 symbols at a time into a word of bits, then shift the bits
+   // through the key register.  A block containing a symbol outside the
+   // alphabet is left to the loop below, which reports it.
+
+   const __m128i zeros = _mm_set1_epi8(char(symbols_[0]));
+   const __m128i ones = _mm_set1_epi8(char(symbols_[1]));
+
+   for (; i + 32 <= length; i += 32)
+   {
+      __m128i low = _mm_loadu_si128((const __m128i*)(data + i));
+      __m128i high = _mm_loadu_si128((const __m128i*)(data + i + 16));
+
+      uint32_t bits = uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(low, ones))) |
+         uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(high, ones))) << 16;
+      uint32_t known = bits |
+         uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(low, zeros))) |
+         uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(high, zeros))) << 16;
+      if (known != 0xFFFFFFFF)
+         break;
+
+      for (unsigned j = 0; j < 32; j++, bits >>= 1)
+      {
+         key = ((key << 1) | (bits & 1)) & mask_;
+         if (++counts[key] == 0)
+            ++dense_overflow_[key];
+      }
+   }
+#endif
+
+   for (; i < length; i++)
+   {
+      key = ((key << 1) | Code(data[i])) & mask_;
+      if (++counts[key] == 0)
+         ++dense_overflow_[key];
+   }
+
+   return key;
+}
+
+void NGramCounter::UpdateWide(const unsigned char* data, size_t length)
+{
+   // A polynomial hash of the N most recent codes is rolled along with the
+   // message.  Keys are compared in full, so hash collisions only cost time.
+
+   for (size_t i = 0; i < length; i++)
+   {
+      unsigned code = Code(data[i]);
+
+      if (history_length_ == history_.size())
+      {
+         memmove(&history_[0], &history_[history_length_ - N_], N_);
+         history_length_ = N_;
+      }
+
+      if (filled_ == N_)
+      {
+         hash_ -= (history_[history_length_ - N_] + 1)*hash_power_;
+         --filled_;
+      }
+
+      hash_ = hash_*ROLLING_PRIME + (code + 1);
+      history_[history_length_++] = (unsigned char)code;
+
+      if (++filled_ == N_)
+      {
+         IncrementWide(hash_, &history_[history_length_ - N_]);
+         ++samples_;
+      }
+   }
+}
+
+void NGramCounter::IncrementHashed(uint64_t key, uint64_t count)
+{
+   size_t mask = hashed_.size() - 1;
+   for (size_t i = SlotIndex(key, hashed_.size()); ; i = (i + 1) & mask)
+   {
+      HashedSlot& slot = hashed_[i];
+      if (slot.count == 0)
+      {
+         slot.key = key;
+         slot.count = count;
+         if (++used_*2 > hashed_.size())
+            GrowHashed();
+         return;
+      }
+      if (slot.key == key)
+      {
+         slot.count += count;
+         return;
+      }
+   }
+}
+
+void NGramCounter::IncrementWide(
+   uint64_t hash, const unsigned char* codes, uint64_t count)
+{
+   size_t mask = wide_.size() - 1;
+   for (size_t i = SlotIndex(hash, wide_.size()); ; i = (i + 1) & mask)
+   {
+      WideSlot& slot = wide_[i];
+      if (slot.count == 0)
+      {
+         slot.hash = hash;
+         slot.count = count;
+         slot.offset = wide_keys_.size();
+         wide_keys_.insert(wide_keys_.end(), codes, codes + N_);
+         if (++used_*2 > wide_.size())
+            GrowWide();
+         return;
+      }
+      if (slot.hash == hash &&
+         memcmp(&wide_keys_[size_t(slot.offset)], codes, N_) == 0)
+      {
+         slot.count += count;
+         return;
+      }
+   }
+}
+
+void NGramCounter::GrowHashed()
+{
+   std::vector<HashedSlot> table(hashed_.size()*2);
+   size_t mask = table.size() - 1;
+
+   for (size_t j = 0; j < hashed_.size(); j++)
+   {
+      if (hashed_[j].count == 0)
+         continue;
+      size_t i = SlotIndex(hashed_[j].key, table.size());
+      while (table[i].count != 0)
+         i = (i + 1) & mask;
+      table[i] = hashed_[j];
+   }
+
+   hashed_.swap(table);
+}
+
+void NGramCounter::GrowWide()
+{
+   std::vector<WideSlot> table(wide_.size()*2);
+   size_t mask = table.size() - 1;
+
+   for (size_t j = 0; j < wide_.size(); j++)
+   {
+      if (wide_[j].count == 0)
+         continue;
+      size_t i = SlotIndex(wide_[j].hash, table.size());
+      while (table[i].count != 0)
+         i = (i + 1) & mask;
+      table[i] = wide_[j];
+   }
+
+   wide_.swap(table);
+}
+
+size_t NGramCounter::Distinct() const
+{
+   if (storage_ != DENSE)
+      return used_;
+
+   size_t distinct = 0;
+   for (size_t key = 0; key < dense_.size(); key++)
+      if (dense_[key] != 0 || dense_overflow_.count(key) != 0)
+         ++distinct;
+   return distinct;
+}
+
+namespace
+{
+   struct HashedSlotKeyLess
+   {
+      template <typename Slot>
+      bool operator()(const Slot& a, const Slot& b) const
+      {
+         return a.key < b.key;
+      }
+   };
+
+   struct WideSlotKeyLess
+   {
+      WideSlotKeyLess(const unsigned char* keys, size_t N)
+         : keys(keys), N(N) {}
+
+      template <typename Slot>
+      bool operator()(const Slot& a, const Slot& b) const
+      {
+         return memcmp(keys + a.offset, keys + b.offset, N) < 0;
+      }
+
+      const unsigned char* keys;
+      size_t N;
+   };
+}
+
+void NGramCounter::Counts(std::vector<uint64_t>& counts) const
+{
+   counts.clear();
+
+   if (storage_ == DENSE)
+   {
+      for (size_t key = 0; key < dense_.size(); key++)
+      {
+         uint64_t count = dense_[key];
+         if (!dense_overflow_.empty())
+         {
+            std::map<uint64_t, uint64_t>::const_iterator it =
+               dense_overflow_.find(key);
+            if (it != dense_overflow_.end())
+               count += it->second << 32;
+         }
+         if (count != 0)
+            counts.push_back(count);
+      }
+   }
+   else if (storage_ == HASHED)
+   {
+      std::vector<HashedSlot> slots;
+      slots.reserve(used_);
+      for (size_t i = 0; i < hashed_.size(); i++)
+         if (hashed_[i].count != 0)
+            slots.push_back(hashed_[i]);
+
+      std::sort(slots.begin(), slots.end(), HashedSlotKeyLess());
+
+      counts.reserve(slots.size());
+      for (size_t i = 0; i < slots.size(); i++)
+         counts.push_back(slots[i].count);
+   }
+   else
+   {
+      std::vector<WideSlot> slots;
+      slots.reserve(used_);
+      for (size_t i = 0; i < wide_.size(); i++)
+         if (wide_[i].count != 0)
+            slots.push_back(wide_[i]);
+
+      if (!slots.empty())
+         std::sort(slots.begin(), slots.end(),
+            WideSlotKeyLess(&wide_keys_[0], N_));
+
+      counts.reserve(slots.size());
+      for (size_t i = 0; i < slots.size(); i++)
+         counts.push_back(slots[i].count);
+   }
+}
+
+namespace
+{
+   // c*ln(c) is looked up for counts below SMALL_COUNT, which are most of
+   // the distinct counts of any message
+   const size_t SMALL_COUNT = 4096;
+
+   struct CLogCTable
+   {
+      CLogCTable()
+      {
+         values[0] = 0.0;
+         for (size_t c = 1; c < SMALL_COUNT; c++)
+            values[c] = c*log(double(c));
+      }
+
+      double values[SMALL_COUNT];
+   };
+
+   const CLogCTable C_LOG_C;
+
+   inline double CLogC(uint64_t c)
+   {
+      return c < SMALL_COUNT ? C_LOG_C.values[c] : c*log(double(c));
+   }
+}
+
+CountProfile::CountProfile(const NGramCounter& counter)
+   : N_(counter.N()), samples_(0), distinct_(0)
+{
+   if (counter.storage_ == NGramCounter::DENSE)
+   {
+      const uint32_t* dense = counter.dense_.empty() ? 0 : &counter.dense_[0];
+      for (size_t key = 0; key < counter.dense_.size(); key++)
+         if (dense[key] != 0 && counter.dense_overflow_.count(key) == 0)
+            Add(dense[key]);
+
+      // counts that wrapped around
+      std::map<uint64_t, uint64_t>::const_iterator it;
+      for (it = counter.dense_overflow_.begin();
+         it != counter.dense_overflow_.end(); it++)
+         Add(dense[it->first] + (it->second << 32));
+   }
+   else if (counter.storage_ == NGramCounter::HASHED)
+   {
+      for (size_t i = 0; i < counter.hashed_.size(); i++)
+         if (counter.hashed_[i].count != 0)
+            Add(counter.hashed_[i].count);
+   }
+   else
+   {
+      for (size_t i = 0; i < counter.wide_.size(); i++)
+         if (counter.wide_[i].count != 0)
+            Add(counter.wide_[i].count);
+   }
+}
+
+void CountProfile::Add(uint64_t count, uint64_t frequency)
+{
+   if (count == 0 || frequency == 0)
+      return;
+
+   if (count < SMALL_COUNT)
+   {
+      if (small_.size() <= count)
+         small_.resize(size_t(count) + 1);
+      small_[size_t(count)] += frequency;
+   }
+   else
+   {
+      large_[count] += frequency;
+   }
+
+   samples_ += count*frequency;
+   distinct_ += frequency;
+}
+
+void CountProfile::Frequencies(
+   std::vector<std::pair<uint64_t, uint64_t> >& frequencies) const
+{
+   frequencies.clear();
+   for (size_t k = 1; k < small_.size(); k++)
+      if (small_[k] != 0)
+         frequencies.push_back(std::make_pair(uint64_t(k), small_[k]));
+   frequencies.insert(frequencies.end(), large_.begin(), large_.end());
+}
+
+double CountProfile::SumCLogC() const
+{
+   double sum = 0.0;
+   for (size_t k = 2; k < small_.size(); k++)
+      sum += small_[k]*C_LOG_C.values[k];
+   std::map<uint64_t, uint64_t>::const_iterator it;
+   for (it = large_.begin(); it != large_.end(); it++)
+      sum += it->second*CLogC(it->first);
+   return sum;
+}
+
+double CountProfile::PlugIn() const
+{
+   std::vector<std::pair<uint64_t, uint64_t> > frequencies;
+   Frequencies(frequencies);
+
+   double samples = double(samples_);
+   double sum = 0.0;
+   for (size_t i = 0; i < frequencies.size(); i++)
+   {
+      double p = double(frequencies[i].first)/samples;
+      sum -= frequencies[i].second*(p*log(p));
+   }
+   return sum;
+}
+
+namespace
+{
+   // Digamma is the derivative of log(Gamma(x)), for x > 0, by recurrence
+   // up to where its asymptotic series is accurate.
+   double Digamma(double x)
+   {
+      double result = 0.0;
+      for (; x < 6.0; x += 1.0)
+         result -= 1.0/x;
+      double y = 1.0/(x*x);
+      return result + log(x) - 0.5/x -
+         y*(1.0/12 - y*(1.0/120 - y*(1.0/252 - y*(1.0/240 - y/132))));
+   }
+}
+
+/* static */ EntropyCalculator::Estimates EntropyCalculator::BiasCorrectedG_N(
+   const std::string& message, size_t N, unsigned threads)
+{
+   return BiasCorrectedG_N(message.data(), message.length(), N, threads);
+}
+
+/* static */ EntropyCalculator::Estimates EntropyCalculator::BiasCorrectedG_N(
+   const void* message, size_t message_length, size_t N, unsigned threads)
+{
+   if (N == 0)
+      throw std::exception("N must be greater than zero");
+   if (N > message_length)
+      throw std::exception("N must be less than or equal to message length");
+
+   NGramCounter counter(N,
+      FindAlphabet((const unsigned char*)message, message_length, threads),
+      message_length - N + 1);
+   counter.Update(message, message_length, threads);
+
+   return BiasCorrectedG_N(counter);
+}
+
+/* static */ EntropyCalculator::Estimates EntropyCalculator::BiasCorrectedG_N(
+   const NGramCounter& counter)
+{
+   return BiasCorrectedG_N(CountProfile(counter));
+}
+
+/* static */ EntropyCalculator::Estimates EntropyCalculator::BiasCorrectedG_N(
+   const CountProfile& profile)
+{
+   uint64_t samples = profile.Samples();
+   if (samples == 0)
+      throw std::exception("no sequences of length N have been counted");
+
+   // The estimates, in nats, for counts c_i of K N-grams in n samples:
+   //   plug-in       log(n) - sum(c*log(c))/n
+   //   Miller-Madow  plug-in + (K-1)/2n
+   //   jackknife     n*plug-in - (n-1)/n*sum(c*H_c), where H_c is the
+   //                 plug-in with one sample of a c-count N-gram left out
+   //   Grassberger   log(n) - sum(c*G(c))/n, where G(c) = psi(c) +
+   //                 (-1)^c*(psi((c+1)/2) - psi(c/2))/2
+   //   Chao-Shen     -sum(p*log(p)/(1 - (1-p)^n)), where p = C*c/n and the
+   //                 coverage C = 1 - f1/n for f1 singletons
+   // Each term depends only on c, so it is found once for each count and
+   // weighted by the number of N-grams with that count.
+
+   std::vector<std::pair<uint64_t, uint64_t> > frequencies;
+   profile.Frequencies(frequencies);
+
+   double n = double(samples);
+   double K = double(profile.Distinct());
+   double c_log_c = profile.SumCLogC();
+   double f1 = frequencies[0].first == 1 ? double(frequencies[0].second) : 0.0;
+   double plug_in = profile.PlugIn();
+
+   double coverage = 1.0 - std::min(f1, n - 1.0)/n;
+   if (samples == 1)
+      coverage = 1.0;
+
+   double jackknife_sum = 0.0, grassberger_sum = 0.0, chao_shen = 0.0;
+   for (size_t i = 0; i < frequencies.size(); i++)
+   {
+      uint64_t count = frequencies[i].first;
+      double c = double(count);
+      double f = double(frequencies[i].second);
+
+      if (samples > 1)
+      {
+         double left_out = log(n - 1.0) -
+            (c_log_c - CLogC(count) + CLogC(count - 1))/(n - 1.0);
+         jackknife_sum += f*c*left_out;
+      }
+
+      double G = Digamma(c) + ((count & 1) ? -0.5 : 0.5)*
+         (Digamma((c + 1.0)/2.0) - Digamma(c/2.0));
+      grassberger_sum += f*c*G;
+
+      double p = coverage*c/n;
+      chao_shen -= f*p*log(p)/(1.0 - exp(n*log1p(-p)));
+   }
+
+   // in bits per symbol, converted as G_N converts
+   size_t N = profile.N();
+   double jackknife = samples > 1 ?
+      n*plug_in - (n - 1.0)/n*jackknife_sum : plug_in;
+
+   Estimates estimates;
+   estimates.plug_in = plug_in/N/log(2.0);
+   estimates.miller_madow = (plug_in + (K - 1.0)/(2.0*n))/N/log(2.0);
+   estimates.jackknife = jackknife/N/log(2.0);
+   estimates.grassberger = (log(n) - grassberger_sum/n)/N/log(2.0);
+   estimates.chao_shen = chao_shen/N/log(2.0);
+   return estimates;
+}
+
+/* static */ double EntropyCalculator::F_N(
+   const std::string& message, size_t N, unsigned threads)
+{
+   return F_N(message.data(), message.length(), N, threads);
+}
+
+/* static */ double EntropyCalculator::F_N(
+   const void* message, size_t message_length, size_t N, unsigned threads)
+{
+   if (N == 0)
+      throw std::exception("N must be greater than zero");
+   if (N > message_length)
+      throw std::exception("N must be less than or equal to message length");
+
+   NGramCounter counter(N,
+      FindAlphabet((const unsigned char*)message, message_length, threads),
+      message_length - N + 1);
+   counter.Update(message, message_length, threads);
+
+   return F_N(counter);
+}
+
+/* static */ double EntropyCalculator::F_N(const NGramCounter& counter)
+{
+   size_t N = counter.N();
+   if (N == 1)
+      return G_N(counter);
+
+   return N*G_N(counter) - (N - 1)*G_N(counter.Marginal(N - 1));
+}
+
+EntropyStream::EntropyStream(
+   size_t N, const std::string& alphabet, unsigned threads)
+   : counter_(N, alphabet), alphabet_(alphabet), threads_(threads),
+   length_(0)
+{
+}
+
+void EntropyStream::Update(const void* data, size_t length)
+{
+   // Counting each update on fresh counters and merging them would cost a
+   // table allocation and a merge per thread per block, so the per-thread
+   // counters are kept until the counts are asked for.
+
+   if (threads_ > 1 && workers_.empty())
+   {
+      workers_.reserve(threads_);
+      for (unsigned i = 0; i < threads_; i++)
+      {
+         workers_.push_back(NGramCounter(
+            counter_.N(), alphabet_, length/threads_));
+      }
+   }
+
+   if (threads_ > 1)
+      counter_.Update(data, length, workers_);
+   else
+      counter_.Update(data, length);
+   length_ += length;
+}
+
+namespace
+{
+   // small enough for a block to stay in cache from being generated to being
+   // counted
+   const size_t STREAM_BLOCK = 256*1024;
+}
+
+void EntropyStream::Update(MessageProducer& producer, uint64_t length,
+   bool pipelined)
+{
+   if (length == 0)
+      return;
+
+   // each counting thread gets a whole block
+   size_t block = STREAM_BLOCK*std::max(threads_, 1u);
+   if (length < block)
+      block = size_t(length);
+
+   if (!pipelined)
+   {
+      std::vector<char> buffer(block);
+      for (uint64_t done = 0; done < length; )
+      {
+         size_t count = size_t(std::min(uint64_t(block), length - done));
+         producer.Produce(&buffer[0], count);
+         Update(&buffer[0], count);
+         done += count;
+      }
+      return;
+   }
+
+   // The producer fills the two buffers in turn, each once it has been
+   // counted.  Whichever side fails first stops the other.
+
+   std::vector<char> buffers[2] = {
+      std::vector<char>(block), std::vector<char>(block) };
+   size_t counts[2] = { 0, 0 };
+   bool full[2] = { false, false };
+   bool stop = false;
+   std::exception_ptr failure;
+   std::mutex mutex;
+   std::condition_variable changed;
+
+   std::thread thread([&]()
+   {
+      try
+      {
+         for (uint64_t done = 0, b = 0; done < length; b ^= 1)
+         {
+            {
+               std::unique_lock<std::mutex> lock(mutex);
+               changed.wait(lock, [&]() { return !full[b] || stop; });
+               if (stop)
+                  return;
+            }
+
+            size_t count = size_t(std::min(uint64_t(block), length - done));
+            producer.Produce(&buffers[b][0], count);
+            done += count;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            counts[b] = count;
+            full[b] = true;
+            changed.notify_all();
+         }
+      }
+      catch (...)
+      {
+         std::lock_guard<std::mutex> lock(mutex);
+         failure = std::current_exception();
+         stop = true;
+         changed.notify_all();
+      }
+   });
+
+   try
+   {
+      for (uint64_t done = 0, b = 0; done < length; b ^= 1)
+      {
+         {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&]() { return full[b] || stop; });
+            if (!full[b])
+               break; // the producer failed
+         }
+
+         Update(&buffers[b][0], counts[b]);
+         done += counts[b];
+
+         std::lock_guard<std::mutex> lock(mutex);
+         full[b] = false;
+         changed.notify_all();
+      }
+   }
+   catch (...)
+   {
+      {
+         std::lock_guard<std::mutex> lock(mutex);
+         stop = true;
+         changed.notify_all();
+      }
+      thread.join();
+      throw;
+   }
+
+   thread.join();
+   if (failure)
+      std::rethrow_exception(failure);
+}
+
+double EntropyStream::G_N() const
+{
+   Collect();
+   return EntropyCalculator::G_N(counter_);
+}
+
+double EntropyStream::F_N() const
+{
+   Collect();
+   return EntropyCalculator::F_N(counter_);
+}
+
+const NGramCounter& EntropyStream::Counter() const
+{
+   Collect();
+   return counter_;
+}
+
+void EntropyStream::Collect() const
+{
+   if (workers_.empty())
+      return;
+
+   counter_.MergeWorkers(workers_);
+   workers_.clear();
+}
+
+EntropyMonitor::EntropyMonitor(
+   size_t N, size_t W, const std::string& alphabet)
+   : N_(N), bits_(0), key_(0), mask_(0), filled_(0), next_(0), samples_(0),
+   scale_(1.0), sum_(0)
+{
+   if (N == 0)
+      throw std::exception("N must be greater than zero");
+   if (W < N)
+      throw std::exception("W must be at least N");
+
+   size_t symbols = 0;
+   for (int c = 0; c < 256; c++)
+      codes_[c] = alphabet.empty() ? uint16_t(c) : NO_CODE;
+   if (alphabet.empty())
+      symbols = 256;
+   for (size_t i = 0; i < alphabet.length(); i++)
+   {
+      unsigned char symbol = (unsigned char)alphabet[i];
+      if (codes_[symbol] == NO_CODE)
+         codes_[symbol] = uint16_t(symbols++);
+   }
+
+   bits_ = SymbolBits(symbols);
+   if (!Packable(N, bits_))
+      throw std::exception("N-grams must fit in 64 bits");
+
+   unsigned key_bits = unsigned(N*bits_);
+   mask_ = key_bits == 64 ? ~uint64_t(0) : (uint64_t(1) << key_bits) - 1;
+
+   size_t window_samples = W - N + 1;
+   keys_.resize(window_samples);
+
+   // A window never holds more distinct N-grams than samples, so a table of
+   // twice that size never fills up.
+
+   if (key_bits <= DENSE_BITS)
+   {
+      dense_.resize(size_t(1) << key_bits);
+   }
+   else
+   {
+      size_t table_size = INITIAL_TABLE_SIZE;
+      while (table_size < 2*window_samples)
+         table_size *= 2;
+      Slot empty = { 0, 0 };
+      table_.resize(table_size, empty);
+   }
+
+   // Scale c*ln(c) so that the largest possible sum fills 62 bits.
+
+   double most = double(window_samples)*log(double(window_samples)) + 1.0;
+   scale_ = ldexp(1.0, 62 - int(ceil(log(most)/log(2.0))));
+
+   c_log_c_.resize(window_samples + 1);
+   for (size_t c = 1; c <= window_samples; c++)
+      c_log_c_[c] = int64_t(floor(c*log(double(c))*scale_ + 0.5));
+}
+
+void EntropyMonitor::Update(const void* data, size_t length)
+{
+   const unsigned char* symbols = (const unsigned char*)data;
+   for (size_t i = 0; i < length; i++)
+      Update(symbols[i]);
+}
+
+void EntropyMonitor::Update(unsigned char symbol)
+{
+   unsigned code = codes_[symbol];
+   if (code == NO_CODE)
+      throw std::exception("symbol is not in the alphabet");
+
+   key_ = ((key_ << bits_) | code) & mask_;
+   if (filled_ + 1 < N_)
+   {
+      ++filled_;
+      return;
+   }
+
+   if (samples_ == keys_.size())
+      Decrement(keys_[next_]);
+   else
+      ++samples_;
+
+   Increment(key_);
+   keys_[next_] = key_;
+   if (++next_ == keys_.size())
+      next_ = 0;
+}
+
+size_t EntropyMonitor::FindSlot(uint64_t key) const
+{
+   // the slot holding key, or the empty slot where it belongs
+
+   size_t mask = table_.size() - 1;
+   size_t i = SlotIndex(key, table_.size());
+   while (table_[i].count != 0 && table_[i].key != key)
+      i = (i + 1) & mask;
+   return i;
+}
+
+void EntropyMonitor::Increment(uint64_t key)
+{
+   uint32_t* count = 0;
+   if (!dense_.empty())
+   {
+      count = &dense_[size_t(key)];
+   }
+   else
+   {
+      Slot& slot = table_[FindSlot(key)];
+      slot.key = key;
+      count = &slot.count;
+   }
+
+   sum_ += c_log_c_[*count + 1] - c_log_c_[*count];
+   ++*count;
+}
+
+void EntropyMonitor::Decrement(uint64_t key)
+{
+   if (!dense_.empty())
+   {
+      uint32_t& count = dense_[size_t(key)];
+      sum_ += c_log_c_[count - 1] - c_log_c_[count];
+      --count;
+      return;
+   }
+
+   size_t gap = FindSlot(key);
+   uint32_t& count = table_[gap].count;
+   sum_ += c_log_c_[count - 1] - c_log_c_[count];
+   if (--count != 0)
+      return;
+
+   // Close the gap left in the table so that no probe sequence is broken,
+   // by moving back each following entry that could not be found past it.
+
+   size_t mask = table_.size() - 1;
+   for (size_t i = (gap + 1) & mask; table_[i].count != 0; i = (i + 1) & mask)
+   {
+      size_t home = SlotIndex(table_[i].key, table_.size());
+      bool movable = gap <= i ?
+         home <= gap || home > i : home <= gap && home > i;
+      if (movable)
+      {
+         table_[gap] = table_[i];
+         table_[i].count = 0;
+         gap = i;
+      }
+   }
+}
+
+double EntropyMonitor::G_N() const
+{
+   if (samples_ == 0)
+      throw std::exception("fewer than N symbols have been seen");
+
+   double samples = double(samples_);
+   double sum = double(sum_)/scale_;
+   return (log(samples) - sum/samples)/N_/log(2.0);
+}
+
+const size_t ContextModel::DEFAULT_MEMORY;
+const uint32_t ContextModel::NO_NODE;
+
+namespace
+{
+   // counts are halved when one reaches MAX_MODEL_COUNT
+   const uint32_t MAX_MODEL_COUNT = 1u << 30;
+
+   // nodes are allocated CHUNK_NODES at a time, enough for a chunk to be
+   // backed by large pages
+   const unsigned CHUNK_BITS = 17;
+   const size_t CHUNK_NODES = size_t(1) << CHUNK_BITS;
+}
+
+ContextModel::ContextModel(
+   size_t depth, const std::string& alphabet, size_t memory)
+   : depth_(depth), max_nodes_(0), alphabet_size_(0), used_(0), context_(0),
+   stamp_(0), symbols_(0), probability_(1.0), exponent_(0)
+{
+   max_nodes_ = std::min(memory/sizeof(Node), size_t(NO_NODE));
+   if (max_nodes_ == 0)
+      throw std::exception("memory must hold at least one node");
+
+   for (int c = 0; c < 256; c++)
+   {
+      in_alphabet_[c] = alphabet.empty();
+      excluded_[c] = 0;
+   }
+   for (size_t i = 0; i < alphabet.length(); i++)
+      in_alphabet_[(unsigned char)alphabet[i]] = true;
+   for (int c = 0; c < 256; c++)
+      alphabet_size_ += in_alphabet_[c];
+
+   chunks_.reserve((max_nodes_ + CHUNK_NODES - 1)/CHUNK_NODES);
+   chunks_.resize(1);
+   chunks_[0].resize(std::min(CHUNK_NODES, max_nodes_));
+   Node root = { NO_NODE, NO_NODE, NO_NODE, 0, 0 };
+   chunks_[0][0] = root;
+   used_ = 1;
+   chain_.reserve(depth + 1);
+}
+
+void ContextModel::Update(const void* data, size_t length)
+{
+   const unsigned char* symbols = (const unsigned char*)data;
+   for (size_t i = 0; i < length; i++)
+      Update(symbols[i]);
+}
+
+void ContextModel::Update(unsigned char symbol)
+{
+   if (!in_alphabet_[symbol])
+      throw std::exception("symbol is not in the alphabet");
+
+   if (++stamp_ == 0)
+   {
+      std::fill(excluded_, excluded_ + 256, 0);
+      stamp_ = 1;
+   }
+
+   chain_.clear();
+   for (uint32_t context = context_; context != NO_NODE;
+      context = At(context).suffix)
+   {
+      chain_.push_back(context);
+   }
+
+   // Predict the symbol from the longest context in which it has been
+   // seen.  Each shorter context is reached by an escape, whose probability
+   // is the number of distinct symbols seen in the longer context, and
+   // excludes those symbols, which would not have escaped.  A symbol never
+   // seen at all is coded with equal probability among those left.
+
+   size_t excluded = 0;
+   bool found = false;
+   for (size_t i = 0; i < chain_.size() && !found; i++)
+   {
+      uint64_t total = 0;
+      uint64_t distinct = 0;
+      uint64_t count = 0;
+      for (uint32_t node = At(chain_[i]).child; node != NO_NODE;
+         node = At(node).sibling)
+      {
+         unsigned char next = At(node).symbol;
+         if (excluded_[next] == stamp_)
+            continue;
+         excluded_[next] = stamp_;
+         total += At(node).count;
+         ++distinct;
+         if (next == symbol)
+            count = At(node).count;
+      }
+
+      if (count != 0)
+      {
+         Multiply(count, total + distinct);
+         found = true;
+      }
+      else if (distinct != 0)
+      {
+         Multiply(distinct, total + distinct);
+         excluded += distinct;
+      }
+   }
+   if (!found)
+      Multiply(1, alphabet_size_ - excluded);
+
+   // Count the symbol in every context, from the root up so that each new
+   // node's suffix already exists.  A node at depth depth_ + 1 holds a
+   // count for the longest context but is never a context itself.
+
+   uint32_t suffix = 0;
+   uint32_t next_context = 0;
+   for (size_t i = chain_.size(); i-- > 0; )
+   {
+      uint32_t context = chain_[i];
+      size_t context_depth = chain_.size() - 1 - i;
+
+      uint32_t node = FindChild(context, symbol);
+      if (node == NO_NODE)
+      {
+         if (used_ == max_nodes_)
+         {
+            // start again with only the root, which adapts to the rest of
+            // the message where freezing the nodes would not
+            used_ = 1;
+            At(0).child = NO_NODE;
+            next_context = 0;
+
+            // the symbol is the first one the new trie counts
+            if (max_nodes_ > 1)
+            {
+               node = AddChild(0, symbol, 0);
+               At(node).count = 1;
+               if (depth_ > 0)
+                  next_context = node;
+            }
+            break;
+         }
+         node = AddChild(context, symbol, suffix);
+      }
+
+      if (++At(node).count == MAX_MODEL_COUNT)
+      {
+         for (uint32_t child = At(context).child; child != NO_NODE;
+            child = At(child).sibling)
+         {
+            At(child).count = (At(child).count + 1)/2;
+         }
+      }
+
+      suffix = node;
+      if (context_depth < depth_)
+         next_context = node;
+   }
+
+   context_ = next_context;
+   ++symbols_;
+}
+
+double ContextModel::H() const
+{
+   if (symbols_ == 0)
+      throw std::exception("no symbols have been seen");
+
+   double bits = -(log(probability_)/log(2.0) + double(exponent_));
+   return bits/double(symbols_);
+}
+
+inline ContextModel::Node& ContextModel::At(uint32_t index)
+{
+   return chunks_[index >> CHUNK_BITS][index & (CHUNK_NODES - 1)];
+}
+
+inline const ContextModel::Node& ContextModel::At(uint32_t index) const
+{
+   return chunks_[index >> CHUNK_BITS][index & (CHUNK_NODES - 1)];
+}
+
+uint32_t ContextModel::FindChild(uint32_t parent, unsigned char symbol) const
+{
+   uint32_t node = At(parent).child;
+   while (node != NO_NODE && At(node).symbol != symbol)
+      node = At(node).sibling;
+   return node;
+}
+
+uint32_t ContextModel::AddChild(
+   uint32_t parent, unsigned char symbol, uint32_t suffix)
+{
+   // the chunks allocated before a restart are used again
+   if (used_ == chunks_.size()*CHUNK_NODES)
+   {
+      chunks_.resize(chunks_.size() + 1);
+      chunks_.back().resize(std::min(CHUNK_NODES, max_nodes_ - used_));
+   }
+
+   Node node = { NO_NODE, At(parent).child, suffix, 0, symbol };
+   uint32_t index = uint32_t(used_++);
+   At(index) = node;
+   At(parent).child = index;
+   return index;
+}
+
+void ContextModel::Multiply(uint64_t numerator, uint64_t denominator)
+{
+   // the exponent is kept apart so the probability never underflows
+   probability_ *= double(numerator)/double(denominator);
+   if (probability_ < 1e-100)
+   {
+      int exponent;
+      probability_ = frexp(probability_, &exponent);
+      exponent_ += exponent;
+   }
+}
+
+const size_t RansCoder::BLOCK_LENGTH;
+
+namespace
+{
+   // Each rANS state stays in [RANS_L, 256*RANS_L), and is renormalized a
+   // byte at a time.  Frequencies sum to RANS_TOTAL.
+
+   const uint32_t RANS_L = 1u << 23;
+   const unsigned RANS_SCALE_BITS = 12;
+   const uint32_t RANS_TOTAL = 1u << RANS_SCALE_BITS;
+   const size_t RANS_STATES = 4;
+
+   const char RANS_MAGIC[8] = { 'S', 'H', '1', '9', '4', '8', 'R', 'C' };
+
+   // Numbers in the code are stored little-endian whatever the byte order
+   // of the host, so that a code can be decoded anywhere.
+
+   void StoreLittleEndian(unsigned char* data, uint64_t value, size_t bytes)
+   {
+      for (size_t i = 0; i < bytes; i++)
+         data[i] = (unsigned char)(value >> 8*i);
+   }
+
+   uint64_t LoadLittleEndian(const unsigned char* data, size_t bytes)
+   {
+      uint64_t value = 0;
+      for (size_t i = bytes; i-- > 0; )
+         value = value << 8 | data[i];
+      return value;
+   }
+
+   void AppendLittleEndian(std::string& code, uint64_t value, size_t bytes)
+   {
+      unsigned char data[8];
+      StoreLittleEndian(data, value, bytes);
+      code.append((const char*)data, bytes);
+   }
+
+   // RansSymbol holds what coding a symbol needs, with division by its
+   // frequency done as multiplication by a reciprocal, after Alverson.
+
+   struct RansSymbol
+   {
+      uint32_t x_max; // states this large are renormalized first
+      uint32_t reciprocal;
+      uint32_t bias;
+      uint32_t complement; // RANS_TOTAL - frequency
+      uint32_t shift;
+   };
+
+   void InitRansSymbol(RansSymbol& symbol, uint32_t start, uint32_t frequency)
+   {
+      symbol.x_max = ((RANS_L >> RANS_SCALE_BITS) << 8)*frequency;
+      symbol.complement = RANS_TOTAL - frequency;
+      if (frequency < 2)
+      {
+         // x*(2^32-1) >> 32 is x-1, which the bias makes up
+         symbol.reciprocal = ~0u;
+         symbol.shift = 0;
+         symbol.bias = start + RANS_TOTAL - 1;
+      }
+      else
+      {
+         uint32_t shift = 0;
+         while (frequency > (1u << shift))
+            ++shift;
+         symbol.reciprocal = uint32_t(
+            ((uint64_t(1) << (shift + 31)) + frequency - 1)/frequency);
+         symbol.shift = shift - 1;
+         symbol.bias = start;
+      }
+   }
+
+   // RansPut codes a symbol into state x, writing bytes backwards from end.
+   // x becomes (x/frequency)*RANS_TOTAL + x%frequency + start.
+
+   inline void RansPut(
+      uint32_t& x, unsigned char*& end, const RansSymbol& symbol)
+   {
+      uint32_t state = x;
+      while (state >= symbol.x_max)
+      {
+         *--end = (unsigned char)state;
+         state >>= 8;
+      }
+      uint32_t q = uint32_t(
+         (uint64_t(state)*symbol.reciprocal) >> 32) >> symbol.shift;
+      x = state + symbol.bias + q*symbol.complement;
+   }
+
+   // RansDecoding holds what decoding needs in one context: the symbol
+   // owning each slot of [0, RANS_TOTAL), and each symbol's start and
+   // frequency.
+
+   struct RansDecoding
+   {
+      bool present;
+      unsigned char symbols[RANS_TOTAL];
+      uint16_t start[256];
+      uint16_t frequency[256];
+   };
+
+   // RansGet decodes a symbol from state x, reading bytes forwards from
+   // data, and undoes RansPut.
+
+   inline unsigned char RansGet(uint32_t& x, const unsigned char*& data,
+      const unsigned char* end, const RansDecoding& decoding)
+   {
+      if (!decoding.present)
+         throw std::exception("code is corrupt");
+
+      uint32_t slot = x & (RANS_TOTAL - 1);
+      unsigned char symbol = decoding.symbols[slot];
+      x = decoding.frequency[symbol]*(x >> RANS_SCALE_BITS) + slot -
+         decoding.start[symbol];
+      while (x < RANS_L)
+      {
+         if (data == end)
+            throw std::exception("code is corrupt");
+         x = (x << 8) | *data++;
+      }
+      return symbol;
+   }
+
+   // NormalizeFrequencies scales counts to frequencies summing to
+   // RANS_TOTAL.  Every symbol that occurred keeps a frequency of at least
+   // one, taken from the most frequent symbols first.
+
+   void NormalizeFrequencies(const uint32_t* counts, uint32_t* frequencies)
+   {
+      uint64_t total = 0;
+      for (size_t s = 0; s < 256; s++)
+         total += counts[s];
+
+      uint32_t sum = 0;
+      size_t largest = 0;
+      for (size_t s = 0; s < 256; s++)
+      {
+         frequencies[s] = 0;
+         if (counts[s] == 0)
+            continue;
+         frequencies[s] = std::max(
+            uint32_t(uint64_t(counts[s])*RANS_TOTAL/total), 1u);
+         sum += frequencies[s];
+         if (counts[s] > counts[largest])
+            largest = s;
+      }
+
+      if (sum < RANS_TOTAL)
+      {
+         frequencies[largest] += RANS_TOTAL - sum;
+      }
+      else if (frequencies[largest] > sum - RANS_TOTAL)
+      {
+         frequencies[largest] -= sum - RANS_TOTAL;
+      }
+      else
+      {
+         // the most frequent symbol cannot give all of it, so take one at a
+         // time from whichever frequency is then the largest, which is more
+         // than one while the sum exceeds RANS_TOTAL
+         while (sum > RANS_TOTAL)
+         {
+            size_t top = 0;
+            for (size_t s = 1; s < 256; s++)
+               if (frequencies[s] > frequencies[top])
+                  top = s;
+            --frequencies[top];
+            --sum;
+         }
+      }
+   }
+
+   // CodeBits is the length in bits of the code for the counted symbols
+   // under the frequencies, with their table.
+
+   double CodeBits(const uint32_t* counts, const uint32_t* frequencies)
+   {
+      double bits = 8.0;
+      for (size_t s = 0; s < 256; s++)
+      {
+         if (counts[s] != 0)
+         {
+            bits += counts[s]*(RANS_SCALE_BITS -
+               log(double(frequencies[s]))/log(2.0)) + 24.0;
+         }
+      }
+      return bits;
+   }
+
+   // A table has one less than the number of symbols with a frequency,
+   // then each such symbol and one less than its frequency in two bytes.
+
+   void WriteFrequencies(const uint32_t* frequencies, std::string& code)
+   {
+      size_t number_at = code.size();
+      code.push_back(0);
+      size_t present = 0;
+      for (size_t s = 0; s < 256; s++)
+      {
+         if (frequencies[s] == 0)
+            continue;
+         code.push_back(char(s));
+         AppendLittleEndian(code, frequencies[s] - 1, 2);
+         ++present;
+      }
+      code[number_at] = char(present - 1);
+   }
+
+   void ReadFrequencies(const unsigned char*& data, const unsigned char* end,
+      RansDecoding& decoding)
+   {
+      if (data == end)
+         throw std::exception("code is corrupt");
+      size_t present = size_t(*data++) + 1;
+      if (size_t(end - data) < 3*present)
+         throw std::exception("code is corrupt");
+
+      std::fill(decoding.frequency, decoding.frequency + 256, 0);
+      uint32_t start = 0;
+      for (size_t i = 0; i < present; i++)
+      {
+         unsigned char symbol = data[0];
+         uint32_t frequency = uint32_t(LoadLittleEndian(data + 1, 2)) + 1;
+         data += 3;
+
+         if (decoding.frequency[symbol] != 0 ||
+            start + frequency > RANS_TOTAL)
+         {
+            throw std::exception("code is corrupt");
+         }
+         decoding.start[symbol] = uint16_t(start);
+         decoding.frequency[symbol] = uint16_t(frequency);
+         memset(decoding.symbols + start, symbol, frequency);
+         start += frequency;
+      }
+      if (start != RANS_TOTAL)
+         throw std::exception("code is corrupt");
+      decoding.present = true;
+   }
+
+   // A block is split into RANS_STATES parts of length/RANS_STATES symbols,
+   // the last taking the remainder too, and each part is coded by its own
+   // state.  The states take turns, one symbol from each part at a time,
+   // and then the last codes the remainder.  With order 1 the context of a
+   // symbol is the symbol before it in its part, or 0 at the start.
+
+   // EncodeBlock appends the code of a block: its order, its frequency
+   // tables, and the rANS states followed by the bytes they wrote.  rANS
+   // codes last in, first out, so the symbols are coded from the end of the
+   // block back to the start.
+
+   void EncodeBlock(
+      const unsigned char* block, size_t length, std::string& code)
+   {
+      size_t part_length = length/RANS_STATES;
+      size_t last_part = (RANS_STATES - 1)*part_length;
+
+      // the order-1 counts, then the order-0 counts
+      std::vector<uint32_t> counts(257*256, 0);
+      uint32_t* counts_0 = &counts[256*256];
+      for (size_t j = 0; j < RANS_STATES; j++)
+      {
+         size_t end = j + 1 < RANS_STATES ? (j + 1)*part_length : length;
+         unsigned char context = 0;
+         for (size_t i = j*part_length; i < end; i++)
+         {
+            ++counts[256*context + block[i]];
+            context = block[i];
+         }
+      }
+
+      bool used[256];
+      for (size_t c = 0; c < 256; c++)
+      {
+         used[c] = false;
+         for (size_t s = 0; s < 256; s++)
+         {
+            counts_0[s] += counts[256*c + s];
+            used[c] = used[c] || counts[256*c + s] != 0;
+         }
+      }
+
+      // take the order with the shorter code, tables included
+      std::vector<uint32_t> frequencies(257*256, 0);
+      uint32_t* frequencies_0 = &frequencies[256*256];
+      NormalizeFrequencies(counts_0, frequencies_0);
+      double bits_0 = CodeBits(counts_0, frequencies_0);
+      double bits_1 = 256.0;
+      for (size_t c = 0; c < 256; c++)
+      {
+         if (used[c])
+         {
+            NormalizeFrequencies(&counts[256*c], &frequencies[256*c]);
+            bits_1 += CodeBits(&counts[256*c], &frequencies[256*c]);
+         }
+      }
+      bool order_1 = bits_1 < bits_0;
+
+      code.push_back(char(order_1));
+      if (order_1)
+      {
+         unsigned char bitmap[32] = { 0 };
+         for (size_t c = 0; c < 256; c++)
+            if (used[c])
+               bitmap[c/8] |= (unsigned char)(1 << (c % 8));
+         code.append((const char*)bitmap, sizeof(bitmap));
+         for (size_t c = 0; c < 256; c++)
+            if (used[c])
+               WriteFrequencies(&frequencies[256*c], code);
+      }
+      else
+      {
+         WriteFrequencies(frequencies_0, code);
+      }
+
+      size_t contexts = order_1 ? 256 : 1;
+      std::vector<RansSymbol> symbols(256*contexts);
+      for (size_t c = 0; c < contexts; c++)
+      {
+         const uint32_t* table = order_1 ? &frequencies[256*c] : frequencies_0;
+         uint32_t start = 0;
+         for (size_t s = 0; s < 256; s++)
+         {
+            if (table[s] != 0)
+               InitRansSymbol(symbols[256*c + s], start, table[s]);
+            start += table[s];
+         }
+      }
+
+      // at most two bytes are written for each symbol
+      std::vector<unsigned char> buffer(2*length + 4*RANS_STATES);
+      unsigned char* end = &buffer[0] + buffer.size();
+      uint32_t states[RANS_STATES];
+      std::fill(states, states + RANS_STATES, RANS_L);
+
+      const RansSymbol* table = &symbols[0];
+      size_t mask = order_1 ? 0xFF : 0; // order 0 has one context
+      for (size_t i = length; i-- > RANS_STATES*part_length; )
+      {
+         size_t context = i == last_part ? 0 : block[i - 1];
+         RansPut(states[RANS_STATES - 1], end,
+            table[256*(context & mask) + block[i]]);
+      }
+      for (size_t k = part_length; k-- > 0; )
+      {
+         for (size_t j = RANS_STATES; j-- > 0; )
+         {
+            size_t i = j*part_length + k;
+            size_t context = k == 0 ? 0 : block[i - 1];
+            RansPut(states[j], end, table[256*(context & mask) + block[i]]);
+         }
+      }
+
+      for (size_t j = RANS_STATES; j-- > 0; )
+      {
+         end -= sizeof(states[j]);
+         StoreLittleEndian(end, states[j], sizeof(states[j]));
+      }
+
+      code.append((const char*)end, &buffer[0] + buffer.size() - end);
+   }
+
+   // DecodeBlock decodes length symbols from the size bytes of a block's
+   // code, in the order EncodeBlock coded them in reverse.
+
+   void DecodeBlock(const unsigned char* data, size_t size,
+      unsigned char* block, size_t length)
+   {
+      const unsigned char* end = data + size;
+      if (data == end || *data > 1)
+         throw std::exception("code is corrupt");
+      bool order_1 = *data++ == 1;
+
+      std::vector<RansDecoding> decodings(order_1 ? 256 : 1);
+      for (size_t c = 0; c < decodings.size(); c++)
+         decodings[c].present = false;
+      if (order_1)
+      {
+         if (end - data < 32)
+            throw std::exception("code is corrupt");
+         const unsigned char* bitmap = data;
+         data += 32;
+         for (size_t c = 0; c < 256; c++)
+            if (bitmap[c/8] & (1 << (c % 8)))
+               ReadFrequencies(data, end, decodings[c]);
+      }
+      else
+      {
+         ReadFrequencies(data, end, decodings[0]);
+      }
+
+      uint32_t states[RANS_STATES];
+      if (size_t(end - data) < sizeof(states))
+         throw std::exception("code is corrupt");
+      for (size_t j = 0; j < RANS_STATES; j++)
+      {
+         states[j] = uint32_t(LoadLittleEndian(data, sizeof(states[j])));
+         data += sizeof(states[j]);
+      }
+
+      size_t part_length = length/RANS_STATES;
+      size_t last_part = (RANS_STATES - 1)*part_length;
+      const RansDecoding* tables = &decodings[0];
+      size_t mask = order_1 ? 0xFF : 0;
+      for (size_t k = 0; k < part_length; k++)
+      {
+         for (size_t j = 0; j < RANS_STATES; j++)
+         {
+            size_t i = j*part_length + k;
+            size_t context = k == 0 ? 0 : block[i - 1];
+            block[i] = RansGet(states[j], data, end, tables[context & mask]);
+         }
+      }
+      for (size_t i = RANS_STATES*part_length; i < length; i++)
+      {
+         size_t context = i == last_part ? 0 : block[i - 1];
+         block[i] = RansGet(
+            states[RANS_STATES - 1], data, end, tables[context & mask]);
+      }
+
+      // the states are back where the encoder began, with every byte read
+      for (size_t j = 0; j < RANS_STATES; j++)
+         if (states[j] != RANS_L)
+            throw std::exception("code is corrupt");
+      if (data != end)
+         throw std::exception("code is corrupt");
+   }
+}
+
+/* static */ void RansCoder::Encode(
+   const std::string& message, std::string& code, unsigned threads)
+{
+   Encode(message.data(), message.length(), code, threads);
+}
+
+/* static */ void RansCoder::Encode(const void* message, size_t length,
+   std::string& code, unsigned threads)
+{
+   const unsigned char* symbols = (const unsigned char*)message;
+   size_t blocks = (length + BLOCK_LENGTH - 1)/BLOCK_LENGTH;
+
+   std::vector<std::string> codes(blocks);
+   size_t workers = std::min(size_t(std::max(threads, 1u)), blocks);
+   RunParallel(workers, [&](size_t worker)
+   {
+      for (size_t b = worker; b < blocks; b += workers)
+      {
+         size_t begin = b*BLOCK_LENGTH;
+         EncodeBlock(symbols + begin,
+            std::min(BLOCK_LENGTH, length - begin), codes[b]);
+      }
+   });
+
+   // the magic number and length, then each block's size and code
+   code.assign(RANS_MAGIC, sizeof(RANS_MAGIC));
+   AppendLittleEndian(code, length, sizeof(uint64_t));
+   for (size_t b = 0; b < blocks; b++)
+   {
+      AppendLittleEndian(code, codes[b].size(), sizeof(uint32_t));
+      code.append(codes[b]);
+      std::string().swap(codes[b]);
+   }
+}
+
+/* static */ void RansCoder::Decode(
+   const std::string& code, std::string& message, unsigned threads)
+{
+   Decode(code.data(), code.length(), message, threads);
+}
+
+/* static */ void RansCoder::Decode(const void* code, size_t length,
+   std::string& message, unsigned threads)
+{
+   const unsigned char* data = (const unsigned char*)code;
+   const unsigned char* end = data + length;
+
+   uint64_t total;
+   if (length < sizeof(RANS_MAGIC) + sizeof(total) ||
+      memcmp(data, RANS_MAGIC, sizeof(RANS_MAGIC)) != 0)
+   {
+      throw std::exception("not a rANS code");
+   }
+   total = LoadLittleEndian(data + sizeof(RANS_MAGIC), sizeof(total));
+   data += sizeof(RANS_MAGIC) + sizeof(total);
+   if (total > uint64_t(size_t(-1) - BLOCK_LENGTH))
+      throw std::exception("code is corrupt");
+
+   // find every block before decoding any
+   size_t blocks = size_t((total + BLOCK_LENGTH - 1)/BLOCK_LENGTH);
+   std::vector<std::pair<const unsigned char*, size_t> > block_codes;
+   for (size_t b = 0; b < blocks; b++)
+   {
+      uint32_t size;
+      if (size_t(end - data) < sizeof(size))
+         throw std::exception("code is corrupt");
+      size = uint32_t(LoadLittleEndian(data, sizeof(size)));
+      data += sizeof(size);
+      if (size_t(end - data) < size)
+         throw std::exception("code is corrupt");
+      block_codes.push_back(std::make_pair(data, size_t(size)));
+      data += size;
+   }
+   if (data != end)
+      throw std::exception("code is corrupt");
+
+   message.resize(size_t(total));
+   size_t workers = std::min(size_t(std::max(threads, 1u)), blocks);
+   RunParallel(workers, [&](size_t worker)
+   {
+      for (size_t b = worker; b < blocks; b += workers)
+      {
+         size_t begin = b*BLOCK_LENGTH;
+         DecodeBlock(block_codes[b].first, block_codes[b].second,
+            (unsigned char*)&message[begin],
+            std::min(BLOCK_LENGTH, size_t(total) - begin));
+      }
+   });
+}
+
+namespace
+{
+   // BuildSuffixArray sorts the suffixes of text, whose values are in
+   // [0, upper], by induced sorting (SA-IS) in linear time.
+
+   void BuildSuffixArray(const std::vector<int32_t>& text, int32_t upper,
+      std::vector<int32_t>& sa)
+   {
+      int32_t n = int32_t(text.size());
+      sa.assign(n, -1);
+
+      if (n <= 2)
+      {
+         for (int32_t i = 0; i < n; i++)
+            sa[i] = i;
+         if (n == 2 && text[1] < text[0])
+            std::swap(sa[0], sa[1]);
+         return;
+      }
+
+      // Classify each suffix as S-type (smaller than the next suffix) or
+      // L-type, and find the bucket boundaries of each symbol.
+
+      std::vector<bool> s_type(n);
+      for (int32_t i = n - 2; i >= 0; i--)
+      {
+         s_type[i] = text[i] == text[i + 1] ?
+            s_type[i + 1] : text[i] < text[i + 1];
+      }
+
+      std::vector<int32_t> l_start(upper + 2);
+      std::vector<int32_t> s_start(upper + 2);
+      for (int32_t i = 0; i < n; i++)
+      {
+         if (!s_type[i])
+            ++s_start[text[i]];
+         else
+            ++l_start[text[i] + 1];
+      }
+      for (int32_t c = 0; c <= upper; c++)
+      {
+         s_start[c] += l_start[c];
+         if (c < upper)
+            l_start[c + 1] += s_start[c];
+      }
+
+      // Induce the order of all suffixes from the order of the LMS
+      // (leftmost S-type) suffixes.
+
+      std::vector<int32_t> bucket(upper + 2);
+      auto induce = [&](const std::vector<int32_t>& lms)
+      {
+         std::fill(sa.begin(), sa.end(), -1);
+
+         std::copy(s_start.begin(), s_start.end(), bucket.begin());
+         for (size_t i = 0; i < lms.size(); i++)
+            if (lms[i] != n)
+               sa[bucket[text[lms[i]]]++] = lms[i];
+
+         std::copy(l_start.begin(), l_start.end(), bucket.begin());
+         sa[bucket[text[n - 1]]++] = n - 1;
+         for (int32_t i = 0; i < n; i++)
+         {
+            int32_t v = sa[i];
+            if (v >= 1 && !s_type[v - 1])
+               sa[bucket[text[v - 1]]++] = v - 1;
+         }
+
+         std::copy(l_start.begin(), l_start.end(), bucket.begin());
+         for (int32_t i = n - 1; i >= 0; i--)
+         {
+            int32_t v = sa[i];
+            if (v >= 1 && s_type[v - 1])
+               sa[--bucket[text[v - 1] + 1]] = v - 1;
+         }
+      };
+
+      std::vector<int32_t> lms_index(n + 1, -1);
+      std::vector<int32_t> lms;
+      for (int32_t i = 1; i < n; i++)
+      {
+         if (!s_type[i - 1] && s_type[i])
+         {
+            lms_index[i] = int32_t(lms.size());
+            lms.push_back(i);
+         }
+      }
+      int32_t m = int32_t(lms.size());
+
+      induce(lms);
+      if (m == 0)
+         return;
+
+      // Name the LMS substrings in sorted order, and sort the LMS suffixes
+      // by recursively sorting the string of names.
+
+      std::vector<int32_t> sorted_lms;
+      sorted_lms.reserve(m);
+      for (int32_t i = 0; i < n; i++)
+         if (lms_index[sa[i]] != -1)
+            sorted_lms.push_back(sa[i]);
+
+      std::vector<int32_t> names(m);
+      int32_t name = 0;
+      names[lms_index[sorted_lms[0]]] = 0;
+      for (int32_t i = 1; i < m; i++)
+      {
+         int32_t l = sorted_lms[i - 1];
+         int32_t r = sorted_lms[i];
+         int32_t end_l = lms_index[l] + 1 < m ? lms[lms_index[l] + 1] : n;
+         int32_t end_r = lms_index[r] + 1 < m ? lms[lms_index[r] + 1] : n;
+
+         bool same = end_l - l == end_r - r;
+         if (same)
+         {
+            while (l < end_l && text[l] == text[r])
+            {
+               ++l;
+               ++r;
+            }
+            if (l == n || text[l] != text[r])
+               same = false;
+         }
+         if (!same)
+            ++name;
+         names[lms_index[sorted_lms[i]]] = name;
+      }
+
+      std::vector<int32_t> names_sa;
+      BuildSuffixArray(names, name, names_sa);
+      for (int32_t i = 0; i < m; i++)
+         sorted_lms[i] = lms[names_sa[i]];
+
+      induce(sorted_lms);
+   }
+
+   // BuildLcp finds lcp[i], the length of the longest common prefix of the
+   // suffixes sa[i-1] and sa[i] (with lcp[0] = 0), by Kasai's method.
+
+   void BuildLcp(const std::vector<int32_t>& text,
+      const std::vector<int32_t>& sa, std::vector<int32_t>& lcp)
+   {
+      int32_t n = int32_t(text.size());
+      std::vector<int32_t> rank(n);
+      for (int32_t i = 0; i < n; i++)
+         rank[sa[i]] = i;
+
+      lcp.assign(n, 0);
+      int32_t h = 0;
+      for (int32_t i = 0; i < n; i++)
+      {
+         if (h > 0)
+            --h;
+         if (rank[i] == 0)
+            continue;
+         int32_t j = sa[rank[i] - 1];
+         while (i + h < n && j + h < n && text[i + h] == text[j + h])
+            ++h;
+         lcp[rank[i]] = h;
+      }
+   }
+
+   // SymbolText converts a message to the ranks of its symbols within its
+   // alphabet, for building a suffix array.
+
+   int32_t SymbolText(const unsigned char* message, size_t length,
+      const std::string& alphabet, std::vector<int32_t>& text)
+   {
+      if (length >= size_t(INT32_MAX))
+         throw std::exception("message is too long for a suffix array");
+
+      int32_t ranks[256] = { 0 };
+      for (size_t i = 0; i < alphabet.length(); i++)
+         ranks[(unsigned char)alphabet[i]] = int32_t(i);
+
+      text.resize(length);
+      for (size_t i = 0; i < length; i++)
+         text[i] = ranks[message[i]];
+
+      return int32_t(alphabet.length()) - 1;
+   }
+
+   // SuffixArrayProfile finds G_N for N from 1 to max_N from the suffix array
+   // of the message.  The suffixes that begin with a given n-gram are
+   // adjacent in the suffix array, and form an lcp-interval whose lcp-value
+   // is at least n.  So an lcp-interval of size c with lcp-value l, nested in
+   // one with lcp-value p, is the set of occurrences of one n-gram for each
+   // n in (p, l].  The intervals are visited bottom up with a stack.
+
+   void SuffixArrayProfile(const unsigned char* message, size_t length,
+      const std::string& alphabet, size_t max_N, std::vector<double>& G)
+   {
+      std::vector<int32_t> text;
+      int32_t upper = SymbolText(message, length, alphabet, text);
+
+      std::vector<int32_t> sa;
+      std::vector<int32_t> lcp;
+      BuildSuffixArray(text, upper, sa);
+      BuildLcp(text, sa, lcp);
+      std::vector<int32_t>().swap(sa);
+      std::vector<int32_t>().swap(text);
+
+      // sum_changes[n] is the change in sum(c*ln(c)) over the n-grams from
+      // n-1 to n; n-grams occurring once add nothing
+
+      std::vector<double> sum_changes(max_N + 2, 0.0);
+
+      struct Interval { int32_t lcp; int32_t left; };
+      std::vector<Interval> stack;
+      Interval root = { 0, 0 };
+      stack.push_back(root);
+
+      int32_t n = int32_t(length);
+      for (int32_t i = 1; i <= n; i++)
+      {
+         int32_t value = i < n ? lcp[i] : 0;
+         int32_t left = i - 1;
+
+         while (value < stack.back().lcp)
+         {
+            Interval interval = stack.back();
+            stack.pop_back();
+
+            double c = double(i - interval.left);
+            size_t parent = size_t(std::max(value, stack.back().lcp));
+            size_t top = std::min(size_t(interval.lcp), max_N);
+            if (parent < top)
+            {
+               sum_changes[parent + 1] += CLogC(uint64_t(c));
+               sum_changes[top + 1] -= CLogC(uint64_t(c));
+            }
+
+            left = interval.left;
+         }
+
+         if (value > stack.back().lcp)
+         {
+            Interval interval = { value, left };
+            stack.push_back(interval);
+         }
+      }
+
+      G.resize(max_N);
+      double sum = 0.0;
+      for (size_t N = 1; N <= max_N; N++)
+      {
+         sum += sum_changes[N];
+         double samples = double(length - N + 1);
+         G[N - 1] = (log(samples) - sum/samples)/N/log(2.0);
+      }
+   }
+}
+
+namespace
+{
+   // MarginalProfile finds G_N for N from 1 to the counter's N, using the
+   // counter's marginal counts for the shorter orders.  Only the marginals
+   // are copied, each a fraction of the size of the one before.
+   void MarginalProfile(const NGramCounter& counter, std::vector<double>& G)
+   {
+      size_t max_N = counter.N();
+      G.resize(max_N);
+      G[max_N - 1] = EntropyCalculator::G_N(counter);
+      if (max_N == 1)
+         return;
+
+      NGramCounter marginal = counter.Marginal(max_N - 1);
+      for (size_t N = max_N - 1; ; N--)
+      {
+         G[N - 1] = EntropyCalculator::G_N(marginal);
+         if (N == 1)
+            break;
+         marginal = marginal.Marginal(N - 1);
+      }
+   }
+
+   // ConditionalProfile fills in F_N from G_N.
+   void ConditionalProfile(EntropyCalculator::Profile& profile)
+   {
+      size_t max_N = profile.G.size();
+      profile.F.resize(max_N);
+      profile.F[0] = profile.G[0];
+      for (size_t N = 2; N <= max_N; N++)
+         profile.F[N - 1] = N*profile.G[N - 1] - (N - 1)*profile.G[N - 2];
+   }
+}
+
+/* static */ EntropyCalculator::Profile EntropyCalculator::EntropyProfile(
+   const std::string& message, size_t max_N, unsigned threads)
+{
+   return EntropyProfile(message.data(), message.length(), max_N, threads);
+}
+
+/* static */ EntropyCalculator::Profile EntropyCalculator::EntropyProfile(
+   const void* message, size_t length, size_t max_N, unsigned threads)
+{
+   if (max_N == 0)
+      throw std::exception("N must be greater than zero");
+   if (max_N > length)
+      throw std::exception("N must be less than or equal to message length");
+
+   const unsigned char* symbols = (const unsigned char*)message;
+   std::string alphabet = FindAlphabet(symbols, length, threads);
+
+   Profile profile;
+
+   if (Packable(max_N, SymbolBits(alphabet.length())))
+   {
+      NGramCounter counter(max_N, alphabet, length - max_N + 1);
+      counter.Update(symbols, length, threads);
+      MarginalProfile(counter, profile.G);
+   }
+   else
+   {
+      SuffixArrayProfile(symbols, length, alphabet, max_N, profile.G);
+   }
+
+   ConditionalProfile(profile);
+   return profile;
+}
+
+/* static */ double EntropyCalculator::BitG_N(
+   const void* message, size_t length, size_t N, unsigned threads)
+{
+   if (N == 0)
+      throw std::exception("N must be greater than zero");
+   if (N > 64)
+      throw std::exception("N must be at most 64 bits");
+   if (N > 8*uint64_t(length))
+      throw std::exception("N must be less than or equal to message length");
+
+   NGramCounter counter(N, "01", 8*uint64_t(length) - N + 1);
+   counter.UpdateBits(message, length, threads);
+   return G_N(counter);
+}
+
+/* static */ EntropyCalculator::Profile EntropyCalculator::BitEntropyProfile(
+   const void* message, size_t length, size_t max_N, unsigned threads)
+{
+   if (max_N == 0)
+      throw std::exception("N must be greater than zero");
+   if (max_N > 64)
+      throw std::exception("N must be at most 64 bits");
+   if (max_N > 8*uint64_t(length))
+      throw std::exception("N must be less than or equal to message length");
+
+   NGramCounter counter(max_N, "01", 8*uint64_t(length) - max_N + 1);
+   counter.UpdateBits(message, length, threads);
+
+   Profile profile;
+   MarginalProfile(counter, profile.G);
+   ConditionalProfile(profile);
+   return profile;
+}
+
+namespace
+{
+   // LongestPreviousFactors finds lpf[i], the length of the longest prefix
+   // of the suffix at i that also begins somewhere before i, by Crochemore
+   // and Ilie's method.  The longest such match is with the nearest suffix
+   // on either side of i in the suffix array that begins before i, and the
+   // suffixes still waiting for their nearest one on the right are kept on
+   // a stack.  lcp is overwritten.
+
+   void LongestPreviousFactors(const std::vector<int32_t>& sa,
+      std::vector<int32_t>& lcp, std::vector<int32_t>& lpf)
+   {
+      int32_t n = int32_t(sa.size());
+      lpf.assign(n, 0);
+
+      std::vector<int32_t> stack;
+      stack.push_back(0);
+      for (int32_t i = 1; i <= n; i++)
+      {
+         // past the end, a suffix before the message empties the stack
+         int32_t position = i < n ? sa[i] : -1;
+         int32_t common = i < n ? lcp[i] : 0;
+
+         while (!stack.empty())
+         {
+            int32_t top = stack.back();
+            if (position < sa[top])
+            {
+               lpf[sa[top]] = std::max(lcp[top], common);
+               common = std::min(lcp[top], common);
+            }
+            else if (common <= lcp[top])
+            {
+               lpf[sa[top]] = lcp[top];
+            }
+            else
+            {
+               break;
+            }
+            stack.pop_back();
+         }
+
+         if (i < n)
+         {
+            lcp[i] = common;
+            stack.push_back(i);
+         }
+      }
+   }
+}
+
+/* static */ double EntropyCalculator::LempelZivH(
+   const std::string& message, unsigned threads)
+{
+   return LempelZivH(message.data(), message.length(), threads);
+}
+
+/* static */ double EntropyCalculator::LempelZivH(
+   const void* message, size_t length, unsigned threads)
+{
+   if (length < 2)
+      throw std::exception("message must have at least two symbols");
+
+   const unsigned char* symbols = (const unsigned char*)message;
+
+   std::vector<int32_t> lpf;
+   {
+      std::vector<int32_t> text;
+      int32_t upper = SymbolText(symbols, length,
+         FindAlphabet(symbols, length, threads), text);
+
+      std::vector<int32_t> sa;
+      std::vector<int32_t> lcp;
+      BuildSuffixArray(text, upper, sa);
+      BuildLcp(text, sa, lcp);
+      std::vector<int32_t>().swap(text);
+      LongestPreviousFactors(sa, lcp, lpf);
+   }
+
+   // sum L_i*ln(2)/ln(i+1) over the positions after the first, which has
+   // nothing before it to match
+   double sum = 0.0;
+   for (size_t i = 1; i < length; i++)
+      sum += (lpf[i] + 1.0)/log(i + 1.0);
+
+   return (length - 1)/sum/log(2.0);
+}
+
+/* static */ double EntropyCalculator::ContextModelH(
+   const std::string& message, size_t depth, size_t memory)
+{
+   return ContextModelH(message.data(), message.length(), depth, memory);
+}
+
+/* static */ double EntropyCalculator::ContextModelH(
+   const void* message, size_t length, size_t depth, size_t memory)
+{
+   if (length == 0)
+      throw std::exception("length must be greater than zero");
+
+   const unsigned char* symbols = (const unsigned char*)message;
+   ContextModel model(depth, FindAlphabet(symbols, length), memory);
+   model.Update(symbols, length);
+   return model.H();
+}
+
+/* static */ double EntropyCalculator::CodedH(
+   const std::string& message, unsigned threads)
+{
+   return CodedH(message.data(), message.length(), threads);
+}
+
+/* static */ double EntropyCalculator::CodedH(
+   const void* message, size_t length, unsigned threads)
+{
+   if (length == 0)
+      throw std::exception("length must be greater than zero");
+
+   std::string code;
+   RansCoder::Encode(message, length, code, threads);
+   return 8.0*code.length()/length;
+}
+
+/* static */ double EntropyCalculator::G_N(
+   const std::string& message, size_t N, unsigned threads)
+{
+   return G_N(message.data(), message.length(), N, threads);
+}
+
+/* static */ double EntropyCalculator::G_N(
+   const void* message, size_t message_length, size_t N, unsigned threads)
+{
+   if (N == 0)
+      throw std::exception("N must be greater than zero");
+   if (N > message_length)
+      throw std::exception("N must be less than or equal to message length");
+
+   // count all sequences of length N, using only the symbols that actually
+   // appear so that the N-gram keys are as short as possible
+
+   CountProfile profile;
+   {
+      NGramCounter counter(N,
+         FindAlphabet((const unsigned char*)message, message_length, threads),
+         message_length - N + 1);
+      counter.Update(message, message_length, threads);
+      profile = CountProfile(counter);
+   } // the counts are freed before the sums are taken
+
+   return G_N(profile);
+}
+
+/* static */ double EntropyCalculator::G_N(const NGramCounter& counter)
+{
+   return G_N(CountProfile(counter));
+}
+
+/* static */ double EntropyCalculator::G_N(const CountProfile& profile)
+{
+   uint64_t samples = profile.Samples(); // the number of samples taken
+   if (samples == 0)
+      throw std::exception("no sequences of length N have been counted");
+
+   // The probability of a sequence, p(B_i), is determined by its number of
+   // occurences in the message as a fraction of the total number of samples
+   // taken from the message.  This calculation assumes that "impossible"
+   // sequences (those not found in this message) do not contribute to the sum.
+   // BiasCorrectedG_N allows for them.  The profile finds p*log(p) once for
+   // each distinct count.
+
+   double sum = profile.PlugIn(); // natural log
+
+   return sum/profile.N()/log(2.0); // convert to log2 for binary entropy
 }
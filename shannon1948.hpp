@@ -17,9 +17,355 @@
 // SOFTWARE.
 
 #include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <new>
+#include <random>
+
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#include <string_view>
+#define SHANNON1948_STRING_VIEW
+#endif
 
 namespace shannon1948
 {
+   // RandomEngine is a source of uniformly distributed 64-bit words for
+   // EntropySource.  Words are drawn in batches, so the cost of the virtual
+   // call is spread over many symbols.  To use another generator, derive
+   // from RandomEngine, or wrap a standard generator in StandardEngine.
+
+   class RandomEngine
+   {
+   public:
+
+      virtual ~RandomEngine() {}
+
+      // Fill sets words[0] to words[count-1] to uniform random words.
+      virtual void Fill(uint64_t* words, size_t count) = 0;
+   };
+
+   // Xoshiro256StarStar is Blackman and Vigna's xoshiro256**, a small, fast
+   // generator with 256 bits of state.
+
+   class Xoshiro256StarStar : public RandomEngine
+   {
+   public:
+
+      typedef uint64_t result_type;
+
+      // The state is filled from seed by SplitMix64, as the authors
+      // recommend.
+      explicit Xoshiro256StarStar(uint64_t seed);
+      Xoshiro256StarStar(uint64_t s0, uint64_t s1, uint64_t s2, uint64_t s3);
+
+      void Seed(uint64_t seed);
+
+      static result_type min() { return 0; }
+      static result_type max() { return ~result_type(0); }
+
+      result_type operator()()
+      {
+         uint64_t result = Rotate(s_[1]*5, 7)*9;
+         uint64_t t = s_[1] << 17;
+         s_[2] ^= s_[0];
+         s_[3] ^= s_[1];
+         s_[1] ^= s_[2];
+         s_[0] ^= s_[3];
+         s_[2] ^= t;
+         s_[3] = Rotate(s_[3], 45);
+         return result;
+      }
+
+      virtual void Fill(uint64_t* words, size_t count);
+
+   private:
+
+      static uint64_t Rotate(uint64_t x, int k)
+      {
+         return (x << k) | (x >> (64 - k));
+      }
+
+      uint64_t s_[4];
+   };
+
+   // Pcg64 is O'Neill's PCG generator with 128 bits of state and the XSL RR
+   // output function.  Generators with different streams give unrelated
+   // sequences from the same seed.
+
+   class Pcg64 : public RandomEngine
+   {
+   public:
+
+      typedef uint64_t result_type;
+
+      explicit Pcg64(uint64_t seed, uint64_t stream = 0);
+
+      void Seed(uint64_t seed, uint64_t stream = 0);
+
+      static result_type min() { return 0; }
+      static result_type max() { return ~result_type(0); }
+
+      result_type operator()();
+
+      virtual void Fill(uint64_t* words, size_t count);
+
+   private:
+
+      void Step();
+
+      uint64_t state_high_;
+      uint64_t state_low_;
+      uint64_t increment_high_;
+      uint64_t increment_low_;
+   };
+
+   // Philox4x64 is the counter-based generator of Salmon et al., "Parallel
+   // Random Numbers: As Easy as 1, 2, 3", with 10 rounds.  Each block of four
+   // words is a keyed function of a 256-bit counter, so any part of the
+   // sequence can be produced without producing what comes before it.
+
+   class Philox4x64 : public RandomEngine
+   {
+   public:
+
+      // Block sets output to the four words for counter under key.
+      static void Block(const uint64_t counter[4], const uint64_t key[2],
+         uint64_t output[4]);
+
+      // The engine gives the words of counters {0, stream, 0, 0},
+      // {1, stream, 0, 0}, and so on, under the key {seed, 0}.
+      explicit Philox4x64(uint64_t seed, uint64_t stream = 0);
+
+      // Seek moves to the position'th word of the sequence.
+      void Seek(uint64_t position);
+
+      virtual void Fill(uint64_t* words, size_t count);
+
+   private:
+
+      uint64_t key_[2];
+      uint64_t counter_[4];
+      uint64_t block_[4];
+      unsigned used_; // words of block_ already given out
+   };
+
+   // StandardEngine adapts a standard uniform random bit generator, such as
+   // std::mt19937_64, or one supplied by the user.  Generators with fewer
+   // than 64 random bits per call are called as often as needed.
+
+   template <typename Generator>
+   class StandardEngine : public RandomEngine
+   {
+   public:
+
+      StandardEngine() {}
+      explicit StandardEngine(const Generator& generator)
+         : generator_(generator) {}
+
+      Generator& generator() { return generator_; }
+
+      virtual void Fill(uint64_t* words, size_t count)
+      {
+         // the number of random bits in each call to the generator
+         uint64_t range = uint64_t(Generator::max() - Generator::min());
+         unsigned bits = 0;
+         while (bits < 64 && (range >> bits) != 0)
+            ++bits;
+         if (bits < 64 && range != (uint64_t(1) << bits) - 1)
+            --bits; // use only the whole bits of the range
+
+         for (size_t i = 0; i < count; i++)
+         {
+            uint64_t word = 0;
+            for (unsigned filled = 0; filled < 64; filled += bits)
+            {
+               uint64_t value = uint64_t(generator_() - Generator::min());
+               if (bits < 64)
+                  value &= (uint64_t(1) << bits) - 1;
+               word = filled == 0 ? value : (word << bits) | value;
+            }
+            words[i] = word;
+         }
+      }
+
+   private:
+
+      Generator generator_;
+   };
+
+   typedef StandardEngine<std::mt19937_64> Mt19937_64;
+
+   // SystemEngine draws from the operating system's cryptographic random
+   // source: getrandom on Linux, /dev/urandom on other Unix systems, and
+   // BCryptGenRandom on Windows.  Each Fill is a request to the system, so
+   // it is best used through a BufferedEngine.
+
+   class SystemEngine : public RandomEngine
+   {
+   public:
+
+      SystemEngine();
+      ~SystemEngine();
+
+      virtual void Fill(uint64_t* words, size_t count);
+
+   private:
+
+      SystemEngine(const SystemEngine&); // not copyable
+      SystemEngine& operator=(const SystemEngine&);
+
+      int file_; // /dev/urandom, if getrandom is not used
+   };
+
+   // HardwareEngine draws from the random number instructions of x86
+   // processors.  RDRAND gives the output of a generator that the processor
+   // reseeds from its entropy source.  RDSEED gives the entropy source
+   // itself, more slowly, and may run dry for a moment under load.  On
+   // 32-bit processors each word is made of two 32-bit draws.
+
+   class HardwareEngine : public RandomEngine
+   {
+   public:
+
+      enum Instruction { RDRAND, RDSEED };
+
+      // Supported tells whether this processor has instruction.
+      static bool Supported(Instruction instruction);
+
+      // HardwareEngine throws if the processor does not have instruction.
+      explicit HardwareEngine(Instruction instruction = RDRAND);
+
+      virtual void Fill(uint64_t* words, size_t count);
+
+   private:
+
+      Instruction instruction_;
+   };
+
+   // BufferedEngine draws words from another engine in batches on a thread
+   // of its own, filling one buffer while the other is handed out, so that
+   // a slow source such as SystemEngine or HardwareEngine is read while the
+   // words already drawn are used.  The words are those of the source, in
+   // the same order.
+
+   class BufferedEngine : public RandomEngine
+   {
+   public:
+
+      static const size_t DEFAULT_BATCH = 1 << 16; // words
+
+      explicit BufferedEngine(RandomEngine& source,
+         size_t batch = DEFAULT_BATCH);
+      ~BufferedEngine();
+
+      virtual void Fill(uint64_t* words, size_t count);
+
+   private:
+
+      struct Shared; // the buffers and the thread filling them
+
+      BufferedEngine(const BufferedEngine&); // not copyable
+      BufferedEngine& operator=(const BufferedEngine&);
+
+      Shared* shared_;
+   };
+
+   // AliasTable samples from a discrete distribution in constant time by
+   // Walker's alias method, with the table built by Vose's algorithm.  Each
+   // column stands for one outcome and holds the probability of keeping it,
+   // with the rest of the column given to another outcome, its alias.
+
+   class AliasTable
+   {
+   public:
+
+      AliasTable() {}
+
+      // weights need not sum to 1, but must not be negative and must not
+      // all be zero.
+      explicit AliasTable(const std::vector<double>& weights);
+
+      size_t Size() const { return columns_.size(); }
+
+      // Sample maps a uniform random word to an outcome.  The high 32 bits
+      // of word choose the column, and the low 32 bits decide between its
+      // outcome and its alias.
+      uint32_t Sample(uint64_t word) const
+      {
+         uint32_t j = uint32_t(((word >> 32)*columns_.size()) >> 32);
+         const Column& column = columns_[j];
+         // a mask rather than a branch, which would be mispredicted often
+         uint32_t keep = 0 - uint32_t(uint32_t(word) < column.threshold);
+         return (j & keep) | (column.alias & ~keep);
+      }
+
+      // Sample for count words at once, which is faster than one at a time.
+      void Sample(const uint64_t* words, uint32_t* outcomes, size_t count)
+         const;
+
+      // the columns, for tables kept elsewhere and sampled the same way
+      uint32_t Threshold(size_t j) const { return columns_[j].threshold; }
+      uint32_t Alias(size_t j) const { return columns_[j].alias; }
+
+   private:
+
+      struct Column
+      {
+         uint32_t threshold; // keep the outcome below this, out of 2^32
+         uint32_t alias;     // the outcome itself if the column is full
+      };
+
+      std::vector<Column> columns_;
+   };
+
+   // MarkovSource is a finite state source, like those of Section 3 of
+   // Shannon's paper.  In state i it moves to state j with probability
+   // transitions[i][j], producing the symbol symbols[i][j].
+
+   class MarkovSource
+   {
+   public:
+
+      MarkovSource(const std::vector<std::vector<double> >& transitions,
+         const std::vector<std::string>& symbols);
+
+      size_t States() const { return tables_.size(); }
+
+      // Symbols gives the symbols of the transitions, each once.
+      std::string Symbols() const;
+
+      // Stationary gives the probability of each state in the long run.
+      const std::vector<double>& Stationary() const { return stationary_; }
+
+      // EntropyRate gives H = sum P_i H_i, Shannon's entropy of the source
+      // in bits per symbol, where P_i is the stationary probability of state
+      // i and H_i is the entropy of its transitions.  It is the entropy of
+      // the messages whenever a state and a symbol decide the next state.
+      double EntropyRate() const;
+
+      // Next takes the transition from state chosen by a random word,
+      // giving its symbol and moving state.
+      char Next(size_t& state, uint64_t word) const
+      {
+         size_t next = tables_[state].Sample(word);
+         char symbol = symbols_[state*tables_.size() + next];
+         state = next;
+         return symbol;
+      }
+
+   private:
+
+      std::vector<AliasTable> tables_;
+      std::vector<std::vector<double> > transitions_;
+      std::string symbols_; // symbols_[i*States() + j]
+      std::vector<double> stationary_;
+   };
+
+   class TextModel;
+
    // EntropySource is a class to generate messages that have an expected amount
    // of entropy.
 
@@ -33,6 +379,778 @@ namespace shannon1948
       // Shannon's paper for a graph of how p will affect H.
       static void GenerateBinaryMessage(
          double p, size_t length, std::string& output);
+
+      // GenerateBinaryMessage with its random numbers drawn from engine, so
+      // that messages can be reproduced from a seed and generated on
+      // separate threads with separate engines.  64 symbols are decided at
+      // once by comparing 64 uniform numbers with p a bit at a time, one
+      // random word per bit, stopping when all 64 comparisons are decided.
+      // That takes one word for p = 0.5 and about eight for any other p.
+      // When p is close to 0 or 1, the message is instead generated as runs
+      // of the common symbol, with one random word for each rare symbol.
+      static void GenerateBinaryMessage(RandomEngine& engine,
+         double p, size_t length, std::string& output);
+
+      // GenerateBinaryMessage with a seed instead of an engine draws its
+      // random words from Philox4x64, with each run of 64 symbols taking
+      // its words from its own counters.  So each symbol depends only on the
+      // seed and its position, and threads can generate separate parts of
+      // the message at once.  The message is the same for any number of
+      // threads.
+      static void GenerateBinaryMessage(uint64_t seed, double p,
+         size_t length, std::string& output, unsigned threads = 1);
+
+      // GenerateBinaryMessage into a buffer writes symbols position to
+      // position + length - 1 of the message that the seeded version
+      // generates, so a message too large for memory can be generated a
+      // region at a time, each region on as many threads as are given.
+      static void GenerateBinaryMessage(uint64_t seed, double p,
+         uint64_t position, size_t length, char* output,
+         unsigned threads = 1);
+
+      // GenerateMessage generates a message of independent symbols, where
+      // alphabet[i] has probability probabilities[i].  Each symbol takes one
+      // random word and one lookup in an AliasTable, whatever the size of
+      // the alphabet.
+      static void GenerateMessage(RandomEngine& engine,
+         const std::vector<double>& probabilities, const std::string& alphabet,
+         size_t length, std::string& output);
+
+      // GenerateMessage with a seed takes the word for symbol i from
+      // position i of Philox4x64(seed), so it is the same for any number of
+      // threads.
+      static void GenerateMessage(uint64_t seed,
+         const std::vector<double>& probabilities, const std::string& alphabet,
+         size_t length, std::string& output, unsigned threads = 1);
+
+      static void GenerateMessage(uint64_t seed,
+         const std::vector<double>& probabilities, const std::string& alphabet,
+         uint64_t position, size_t length, char* output,
+         unsigned threads = 1);
+
+      // GenerateMessage with a MarkovSource starts in state, which is left at
+      // the state the message ends in, so that a long message can be
+      // generated a piece at a time.
+      static void GenerateMessage(RandomEngine& engine,
+         const MarkovSource& source, size_t& state, size_t length,
+         std::string& output);
+      static void GenerateMessage(RandomEngine& engine,
+         const MarkovSource& source, size_t& state, size_t length,
+         char* output);
+
+      // GenerateText appends length units generated from model, with words
+      // separated by spaces.
+      static void GenerateText(RandomEngine& engine, const TextModel& model,
+         size_t length, std::string& output);
+
+      // GenerateBinaryBits fills output with length bytes of bits, each of
+      // which is 1 with probability p, generated as GenerateBinaryMessage
+      // generates symbols.  The first bit of each byte is the most
+      // significant, as BitG_N reads them.
+      static void GenerateBinaryBits(RandomEngine& engine,
+         double p, void* output, size_t length);
+
+      // GenerateBinaryBits with a seed writes bytes position to position +
+      // length - 1 of the seeded binary message packed eight symbols to a
+      // byte, most significant bit first as BitG_N reads them: bit 7 - j of
+      // byte k is set if symbol 8k + j is the first.
+      static void GenerateBinaryBits(uint64_t seed, double p,
+         uint64_t position, size_t length, void* output,
+         unsigned threads = 1);
+
+      // GenerateBinaryFile writes length bytes of the seeded binary message
+      // to a new file at path, one symbol to a byte, or packed as by
+      // GenerateBinaryBits if bits is set.  The file is mapped into memory
+      // and generated a window at a time, each window being unmapped once
+      // written, so that the memory used stays bounded however large the
+      // file.
+      static void GenerateBinaryFile(uint64_t seed, double p,
+         uint64_t length, const std::string& path, unsigned threads = 1,
+         bool bits = false);
+   };
+
+   // MessageProducer generates a message a block at a time, for when the
+   // message is only wanted for its estimates and need never be kept whole.
+   // EntropyStream can pull a message from a producer in blocks that stay
+   // in cache between being generated and being counted.
+
+   class MessageProducer
+   {
+   public:
+
+      virtual ~MessageProducer() {}
+
+      // Produce writes the next length symbols of the message to output.
+      virtual void Produce(char* output, size_t length) = 0;
+
+      // Alphabet gives the symbols that the message can contain.
+      virtual std::string Alphabet() const = 0;
+   };
+
+   // BinaryProducer produces the seeded binary message of EntropySource.
+
+   class BinaryProducer : public MessageProducer
+   {
+   public:
+
+      BinaryProducer(uint64_t seed, double p, unsigned threads = 1)
+         : seed_(seed), p_(p), threads_(threads), position_(0) {}
+
+      virtual void Produce(char* output, size_t length);
+      virtual std::string Alphabet() const { return "AB"; }
+
+   private:
+
+      uint64_t seed_;
+      double p_;
+      unsigned threads_;
+      uint64_t position_;
+   };
+
+   // SymbolProducer produces the seeded message of independent symbols of
+   // EntropySource.
+
+   class SymbolProducer : public MessageProducer
+   {
+   public:
+
+      SymbolProducer(uint64_t seed, const std::vector<double>& probabilities,
+         const std::string& alphabet, unsigned threads = 1)
+         : seed_(seed), probabilities_(probabilities), alphabet_(alphabet),
+         threads_(threads), position_(0) {}
+
+      virtual void Produce(char* output, size_t length);
+      virtual std::string Alphabet() const { return alphabet_; }
+
+   private:
+
+      uint64_t seed_;
+      std::vector<double> probabilities_;
+      std::string alphabet_;
+      unsigned threads_;
+      uint64_t position_;
+   };
+
+   // MarkovProducer produces the message of a MarkovSource, drawing its
+   // random words from engine.
+
+   class MarkovProducer : public MessageProducer
+   {
+   public:
+
+      MarkovProducer(RandomEngine& engine, const MarkovSource& source,
+         size_t state = 0)
+         : engine_(engine), source_(source), state_(state) {}
+
+      virtual void Produce(char* output, size_t length);
+      virtual std::string Alphabet() const;
+
+   private:
+
+      MarkovProducer& operator=(const MarkovProducer&); // not assignable
+
+      RandomEngine& engine_;
+      const MarkovSource& source_;
+      size_t state_;
+   };
+
+   // AllocateLarge and FreeLarge get memory directly from the operating
+   // system, asking for it to be backed by huge pages so that large tables
+   // indexed at random do not thrash the TLB.  The memory is zeroed.
+   void* AllocateLarge(size_t bytes);
+   void FreeLarge(void* memory, size_t bytes);
+
+   // LargePageAllocator is a standard allocator that uses AllocateLarge for
+   // allocations of LARGE_ALLOCATION bytes or more.
+
+   const size_t LARGE_ALLOCATION = 2*1024*1024;
+
+   template <typename T>
+   class LargePageAllocator
+   {
+   public:
+
+      typedef T value_type;
+      typedef T* pointer;
+      typedef const T* const_pointer;
+      typedef T& reference;
+      typedef const T& const_reference;
+      typedef size_t size_type;
+      typedef ptrdiff_t difference_type;
+
+      template <typename U>
+      struct rebind { typedef LargePageAllocator<U> other; };
+
+      LargePageAllocator() {}
+      template <typename U>
+      LargePageAllocator(const LargePageAllocator<U>&) {}
+
+      pointer address(reference x) const { return &x; }
+      const_pointer address(const_reference x) const { return &x; }
+      size_type max_size() const { return size_t(-1)/sizeof(T); }
+      void construct(pointer p, const T& value) { new((void*)p) T(value); }
+      void destroy(pointer p) { p->~T(); }
+
+      pointer allocate(size_type n, const void* = 0)
+      {
+         if (n*sizeof(T) >= LARGE_ALLOCATION)
+            return static_cast<pointer>(AllocateLarge(n*sizeof(T)));
+         return static_cast<pointer>(::operator new(n*sizeof(T)));
+      }
+
+      void deallocate(pointer p, size_type n)
+      {
+         if (n*sizeof(T) >= LARGE_ALLOCATION)
+            FreeLarge(p, n*sizeof(T));
+         else
+            ::operator delete(p);
+      }
+   };
+
+   template <typename T, typename U>
+   bool operator==(const LargePageAllocator<T>&, const LargePageAllocator<U>&)
+   {
+      return true;
+   }
+
+   template <typename T, typename U>
+   bool operator!=(const LargePageAllocator<T>&, const LargePageAllocator<U>&)
+   {
+      return false;
+   }
+
+   // MappedFile maps a whole file into memory for reading, so that a message
+   // on disk can be estimated without first being copied into a string.  The
+   // operating system is told that the file will be read sequentially.
+
+   class MappedFile
+   {
+   public:
+
+      explicit MappedFile(const std::string& path);
+      ~MappedFile();
+
+      const char* Data() const { return static_cast<const char*>(data_); }
+      size_t Length() const { return length_; }
+
+   private:
+
+      MappedFile(const MappedFile&); // not copyable
+      MappedFile& operator=(const MappedFile&);
+
+      void* data_;
+      size_t length_;
+   };
+
+   // OutputFile creates a file of length bytes, which is written through a
+   // window of it mapped into memory at a time.  Unmapping a window hands
+   // its pages to the operating system, which writes them out in its own
+   // time, so neither the memory used nor the address space limits the size
+   // of the file.
+
+   class OutputFile
+   {
+   public:
+
+      OutputFile(const std::string& path, uint64_t length);
+      ~OutputFile();
+
+      uint64_t Length() const { return length_; }
+
+      // Map maps bytes offset to offset + length - 1 of the file for
+      // writing, in place of the window mapped before.
+      char* Map(uint64_t offset, size_t length);
+      void Unmap();
+
+   private:
+
+      OutputFile(const OutputFile&); // not copyable
+      OutputFile& operator=(const OutputFile&);
+
+      uint64_t length_;
+      void* mapping_; // the file mapping, on Windows
+      int file_; // the file descriptor, elsewhere
+      void* view_; // the window, from a boundary the system can map at
+      size_t view_length_;
+   };
+
+   // TextModel is an N-gram model of text trained from a corpus, from which
+   // Shannon's approximations to English can be generated: with letters as
+   // units and N = 3 it gives his second-order letter approximation, and
+   // with words and N = 2 his second-order word approximation.  The N-grams
+   // are kept sorted, so those of each context of N-1 units are together,
+   // as an alias table over them that holds the context each leads to.  The
+   // flat arrays are saved to disk as they are, so a saved model is used
+   // straight from a memory mapping with nothing to parse.
+
+   class TextModel
+   {
+   public:
+
+      enum Unit { LETTERS, WORDS };
+
+      // NO_CONTEXT follows an N-gram whose last N-1 units are never followed
+      // by anything, such as the one that ends the corpus.
+      static const uint32_t NO_CONTEXT = 0xFFFFFFFF;
+
+      // TextModel trains a model on the N-grams of corpus, where the units
+      // are bytes for LETTERS, or runs of bytes other than white space for
+      // WORDS.  Separate parts of the corpus are counted on separate threads.
+      TextModel(const void* corpus, size_t length, Unit unit, size_t N,
+         unsigned threads = 1);
+
+      // TextModel with a path maps a model saved by Save.  The file is
+      // trusted to be one that Save wrote on a machine of the same byte
+      // order; only its header and size are checked.
+      explicit TextModel(const std::string& path);
+      ~TextModel();
+
+      void Save(const std::string& path) const;
+
+      Unit GetUnit() const;
+      size_t N() const;
+      size_t Contexts() const;
+      size_t NGrams() const;
+
+      // Start chooses a context, with the probability of its appearing in
+      // the corpus, from a random word.
+      uint32_t Start(uint64_t word) const
+      {
+         uint32_t j = uint32_t(((word >> 32)*Contexts()) >> 32);
+         uint32_t keep = 0 - uint32_t(uint32_t(word) < start_[j].threshold);
+         return (j & keep) | (start_[j].alias & ~keep);
+      }
+
+      // Next chooses the unit to follow context from a random word, and
+      // moves context to the one that the unit ends, which may be
+      // NO_CONTEXT.
+      uint32_t Next(uint32_t& context, uint64_t word) const
+      {
+         uint64_t begin = begin_[context];
+         uint64_t j = ((word >> 32)*(begin_[context + 1] - begin)) >> 32;
+         const Column& column = columns_[begin + j];
+         unsigned alias = uint32_t(word) >= column.threshold;
+         context = column.next[alias];
+         return column.unit[alias];
+      }
+
+      // AppendUnit appends the text of a unit to output.
+      void AppendUnit(uint32_t unit, std::string& output) const;
+
+   private:
+
+      struct Header;
+
+      struct StartColumn
+      {
+         uint32_t threshold;
+         uint32_t alias;
+      };
+
+      // Column holds both outcomes of a column of the alias table of a
+      // context, each with the context it leads to, so that generating a
+      // unit touches one column and nothing else.
+      struct Column
+      {
+         uint32_t threshold;
+         uint32_t unit[2]; // the column's own unit, then its alias's
+         uint32_t next[2];
+      };
+
+      TextModel(const TextModel&); // not copyable
+      TextModel& operator=(const TextModel&);
+
+      void Attach(const char* data, size_t length);
+
+      // a trained model, as it is saved, or a saved one
+      std::vector<uint64_t, LargePageAllocator<uint64_t> > image_;
+      MappedFile* file_;
+
+      const Header* header_;
+      const uint64_t* begin_;       // the first column of each context
+      const StartColumn* start_;    // over contexts
+      const Column* columns_;       // over the N-grams of each context
+      const uint64_t* word_begin_;  // the text of word i is from
+      const char* words_;           // words_ + word_begin_[i]
+   };
+
+   class CountProfile;
+
+   // NGramCounter counts every sequence of N symbols (N-gram) in a message.
+   // Each symbol is first mapped to a dense code, so an N-gram can be packed
+   // into a 64-bit rolling key.  The counts live in a flat array indexed by
+   // the key when the number of possible keys is small, or in an
+   // open-addressing hash table when it is not.  N-grams too wide to pack
+   // into 64 bits are hashed and kept in a separate table.  Two-symbol
+   // messages are classified into bits many symbols at a time and counted
+   // with a rolling N-bit register.
+
+   class NGramCounter
+   {
+   public:
+
+      // alphabet lists the symbols that may appear in the message.  If it is
+      // empty, every byte value is a possible symbol.  expected_samples is a
+      // hint that lets larger flat arrays be used when they will be well
+      // populated.
+      NGramCounter(size_t N, const std::string& alphabet,
+         uint64_t expected_samples = 0);
+
+      // Update counts the N-grams in data.  Successive calls continue the
+      // same message, so N-grams spanning two calls are counted as well.
+      void Update(const void* data, size_t length);
+
+      // Update with threads splits data into chunks that overlap by N-1
+      // symbols, counts each chunk on its own thread and merges the counts.
+      // The result is the same as counting on one thread.
+      void Update(const void* data, size_t length, unsigned threads);
+
+      // Update with workers counts the chunks into workers, one per thread,
+      // which must count the same N-grams as this counter, and does not
+      // merge them.  Workers keep their counts from call to call, so a long
+      // message can be counted a block at a time and merged once at the end
+      // with MergeWorkers.
+      void Update(const void* data, size_t length,
+         std::vector<NGramCounter>& workers);
+      void MergeWorkers(std::vector<NGramCounter>& workers);
+
+      // UpdateBits counts the N-grams of the bits of data, taking the most
+      // significant bit of each byte first, without expanding the bits into
+      // bytes.  The alphabet must have two symbols: the first stands for 0
+      // and the second for 1.  N must be at most 64.
+      void UpdateBits(const void* data, size_t length);
+      void UpdateBits(const void* data, size_t length, unsigned threads);
+
+      // Merge adds the counts taken by other, which must count N-grams of
+      // the same N and alphabet.  The N-grams spanning the end of this
+      // counter's message and the start of other's are not counted.
+      void Merge(const NGramCounter& other);
+
+      // Marginal returns the counts of the n-grams (n < N) of the same
+      // message.  They are found by summing the counts of the N-grams that
+      // each n-gram begins, plus the n-grams in the last N-1 symbols, so the
+      // message is not read again.
+      NGramCounter Marginal(size_t n) const;
+
+      size_t N() const { return N_; }
+      uint64_t Samples() const { return samples_; }
+      size_t Distinct() const;
+
+      // Counts returns the count of every N-gram that occurred, in the
+      // lexicographic order of the N-grams (with symbols ordered as in the
+      // alphabet).
+      void Counts(std::vector<uint64_t>& counts) const;
+
+   private:
+
+      friend class CountProfile;
+
+      enum Storage { DENSE, HASHED, WIDE };
+
+      struct HashedSlot { uint64_t key; uint64_t count; };
+      struct WideSlot { uint64_t hash; uint64_t count; uint64_t offset; };
+
+      void UpdatePacked(const unsigned char* data, size_t length);
+      void UpdateWide(const unsigned char* data, size_t length);
+      uint64_t CountBinary(
+         const unsigned char* data, size_t length, uint64_t key);
+      void CountBits(
+         const unsigned char* data, size_t length, unsigned skip);
+      inline void CountKey(uint64_t key);
+      void Restart(const unsigned char* tail, size_t length);
+      void MergeDense(const NGramCounter& other);
+      void AddPacked(uint64_t key, uint64_t count);
+      void AddCodes(const unsigned char* codes, uint64_t count);
+      void Tail(std::vector<unsigned char>& codes) const;
+      void IncrementHashed(uint64_t key, uint64_t count = 1);
+      void IncrementWide(
+         uint64_t hash, const unsigned char* codes, uint64_t count = 1);
+      void GrowHashed();
+      void GrowWide();
+      inline unsigned Code(unsigned char symbol) const;
+
+      size_t N_;
+      std::string alphabet_;
+      unsigned bits_; // bits per symbol code
+      Storage storage_;
+      uint16_t codes_[256]; // symbol to code, or NO_CODE
+      unsigned char symbols_[256]; // code to symbol
+      uint64_t samples_;
+
+      // packed key state (DENSE and HASHED)
+      uint64_t key_;
+      uint64_t mask_;
+      size_t filled_; // symbols seen so far, up to N-1
+
+      // DENSE: 32-bit counters, with the rare wrap-arounds kept on the side
+      std::vector<uint32_t, LargePageAllocator<uint32_t> > dense_;
+      std::map<uint64_t, uint64_t> dense_overflow_;
+
+      // HASHED and WIDE tables are open-addressed; a count of zero marks an
+      // empty slot
+      size_t used_;
+      std::vector<HashedSlot> hashed_;
+
+      // WIDE: slots index N-code keys stored back to back in wide_keys_
+      std::vector<WideSlot> wide_;
+      std::vector<unsigned char> wide_keys_;
+      std::vector<unsigned char> history_; // most recent codes
+      size_t history_length_;
+      uint64_t hash_;
+      uint64_t hash_power_; // multiplier of the oldest code in hash_
+   };
+
+   // CountProfile is the "histogram of histograms" of N-gram counts: for
+   // each count k, the number of N-grams that occurred exactly k times.
+   // Every estimate of entropy from the counts depends only on it, so it is
+   // all that needs to be kept once counting is done, and sums over it take
+   // one term per distinct count rather than one per N-gram.
+
+   class CountProfile
+   {
+   public:
+
+      // N is the length of the N-grams whose counts are added.
+      explicit CountProfile(size_t N = 1)
+         : N_(N), samples_(0), distinct_(0) {}
+
+      // CountProfile takes the counts of counter, in no particular order.
+      explicit CountProfile(const NGramCounter& counter);
+
+      // Add records frequency more N-grams that each occurred count times.
+      void Add(uint64_t count, uint64_t frequency = 1);
+
+      size_t N() const { return N_; }
+      uint64_t Samples() const { return samples_; }
+      uint64_t Distinct() const { return distinct_; }
+
+      // Frequencies gives each count that occurred, in increasing order,
+      // with the number of N-grams that had it.
+      void Frequencies(
+         std::vector<std::pair<uint64_t, uint64_t> >& frequencies) const;
+
+      // SumCLogC gives sum(c*ln(c)) over the counts, with c*ln(c) looked up
+      // in a table for small c.
+      double SumCLogC() const;
+
+      // PlugIn gives -sum(p*ln(p)) over the N-grams, where p = c/Samples(),
+      // with one term for each distinct count.
+      double PlugIn() const;
+
+   private:
+
+      size_t N_;
+      uint64_t samples_;
+      uint64_t distinct_;
+      std::vector<uint64_t> small_; // small_[k] for k below SMALL_COUNT
+      std::map<uint64_t, uint64_t> large_;
+   };
+
+   // EntropyStream estimates the entropy of a message that arrives in
+   // pieces, such as a network capture or a device dump too large to hold in
+   // memory.  Only the N-gram counts and the last N-1 symbols are kept, so
+   // memory use depends on the number of distinct N-grams and not on the
+   // length of the message.
+
+   class EntropyStream
+   {
+   public:
+
+      // alphabet is as for NGramCounter: if it is empty, every byte value is
+      // a possible symbol.  threads is the number of threads each update is
+      // counted with.
+      EntropyStream(size_t N, const std::string& alphabet = std::string(),
+         unsigned threads = 1);
+
+      // Update continues the message with the next length symbols.
+      void Update(const void* data, size_t length);
+
+      // Update with a producer continues the message with the next length
+      // symbols of producer, generated and counted a block at a time.  If
+      // pipelined, the next block is generated on another thread while the
+      // last one is counted.
+      void Update(MessageProducer& producer, uint64_t length,
+         bool pipelined = false);
+
+      // the estimates for the message so far, which must contain at least N
+      // symbols
+      double G_N() const;
+      double F_N() const;
+
+      uint64_t Length() const { return length_; }
+      const NGramCounter& Counter() const;
+
+   private:
+
+      // Collect merges the counts the workers have taken since the last call
+      // into counter_.
+      void Collect() const;
+
+      mutable NGramCounter counter_;
+      mutable std::vector<NGramCounter> workers_; // one per thread
+      std::string alphabet_;
+      unsigned threads_;
+      uint64_t length_;
+   };
+
+   // EntropyMonitor tracks G_N over the most recent W symbols of a source, so
+   // that a degrading source can be noticed as soon as it happens.  When a
+   // symbol arrives, the count of the N-gram it completes goes up and the
+   // count of the N-gram leaving the window goes down.  sum(c*ln(c)) over
+   // the counts is kept up to date from a table of c*ln(c) in fixed point,
+   // so each update takes constant time and the sum never drifts.  The
+   // N-grams must fit in 64 bits (N*log2(alphabet size) <= 64).
+
+   class EntropyMonitor
+   {
+   public:
+
+      // W is the window length in symbols, at least N.  alphabet is as for
+      // NGramCounter.
+      EntropyMonitor(size_t N, size_t W,
+         const std::string& alphabet = std::string());
+
+      void Update(unsigned char symbol);
+      void Update(const void* data, size_t length);
+
+      // G_N over the last W symbols, or over all of them before there have
+      // been W.  There must have been at least N symbols.
+      double G_N() const;
+
+      size_t Samples() const { return samples_; }
+      bool Full() const { return samples_ == keys_.size(); }
+
+   private:
+
+      struct Slot { uint64_t key; uint32_t count; };
+
+      size_t FindSlot(uint64_t key) const;
+      void Increment(uint64_t key);
+      void Decrement(uint64_t key);
+
+      size_t N_;
+      unsigned bits_;
+      uint16_t codes_[256];
+
+      uint64_t key_;
+      uint64_t mask_;
+      size_t filled_;
+
+      std::vector<uint64_t> keys_; // ring of the N-grams in the window
+      size_t next_; // where the next N-gram goes in keys_
+      size_t samples_; // N-grams in the window
+
+      std::vector<uint32_t> dense_; // counts, if the keys are short
+      std::vector<Slot> table_; // otherwise an open-addressed table
+
+      std::vector<int64_t> c_log_c_; // c*ln(c)*scale_
+      double scale_;
+      int64_t sum_; // sum(c*ln(c))*scale_ over the window
+   };
+
+   // ContextModel estimates the entropy rate as the code length per symbol
+   // of an adaptive context model: PPM with escape method C and exclusion.
+   // Each symbol is predicted from the longest context of up to depth
+   // symbols seen before, escaping to shorter contexts when the symbol has
+   // not yet followed a longer one.  The contexts are the nodes of a trie
+   // linked by 32-bit indices and held in fixed-size chunks, allocated as
+   // the trie grows, so a short message takes little memory and no large
+   // contiguous block is needed.  When memory bytes of nodes are in use the
+   // model starts again from a trie holding only the symbol that did not
+   // fit, so a deep model of a long message stays within a fixed budget.
+
+   class ContextModel
+   {
+   public:
+
+      static const size_t DEFAULT_MEMORY = size_t(1) << 28; // bytes
+
+      // alphabet is as for NGramCounter.
+      ContextModel(size_t depth, const std::string& alphabet = std::string(),
+         size_t memory = DEFAULT_MEMORY);
+
+      void Update(unsigned char symbol);
+      void Update(const void* data, size_t length);
+
+      // H is the code length of the symbols so far, in bits per symbol.
+      // There must have been at least one symbol.
+      double H() const;
+
+      uint64_t Symbols() const { return symbols_; }
+      size_t Nodes() const { return used_; }
+
+   private:
+
+      static const uint32_t NO_NODE = 0xFFFFFFFF;
+
+      // A node stands for a string: the context of its parent followed by
+      // symbol.  count is the number of times the string has occurred.
+      struct Node
+      {
+         uint32_t child;
+         uint32_t sibling;
+         uint32_t suffix; // the node for the string without its first symbol
+         uint32_t count;
+         unsigned char symbol;
+      };
+
+      inline Node& At(uint32_t index);
+      inline const Node& At(uint32_t index) const;
+      uint32_t FindChild(uint32_t parent, unsigned char symbol) const;
+      uint32_t AddChild(
+         uint32_t parent, unsigned char symbol, uint32_t suffix);
+      void Multiply(uint64_t numerator, uint64_t denominator);
+
+      size_t depth_;
+      size_t max_nodes_;
+      bool in_alphabet_[256];
+      size_t alphabet_size_;
+
+      // node i is chunks_[i/CHUNK_NODES][i%CHUNK_NODES]; the root is 0
+      std::vector<std::vector<Node, LargePageAllocator<Node> > > chunks_;
+      size_t used_; // nodes in use
+      uint32_t context_; // the longest context of the next symbol
+      std::vector<uint32_t> chain_; // contexts from the longest to the root
+
+      uint32_t excluded_[256]; // symbols excluded if equal to stamp_
+      uint32_t stamp_;
+
+      uint64_t symbols_;
+      double probability_; // of the symbols so far is probability_*2^exponent_
+      int64_t exponent_;
+   };
+
+   // RansCoder compresses a message with range asymmetric numeral systems
+   // (rANS) under a static model of order 0 or 1, so that the length of the
+   // code can be checked against the statistical estimates.  The message
+   // is coded in blocks, each with order-0 or order-1 symbol frequencies,
+   // whichever gives the shorter code, stored ahead of it.  Each block is
+   // split into four parts coded by four interleaved rANS states, so that
+   // successive steps do not wait on each other, and blocks are coded on
+   // separate threads.
+   //
+   // The frequencies are counted over the block before it is coded and do
+   // not adapt within it, and no context is longer than one symbol, so the
+   // code is no shorter than the order-1 conditional entropy of each block.
+   // It is not an adaptive context-mixing coder.  For sources with longer
+   // memory the bound is loose; ContextModel adapts to deeper contexts.
+
+   class RansCoder
+   {
+   public:
+
+      static const size_t BLOCK_LENGTH = 1 << 20; // symbols
+
+      static void Encode(const std::string& message, std::string& code,
+         unsigned threads = 1);
+      static void Encode(const void* message, size_t length, std::string& code,
+         unsigned threads = 1);
+
+      // Decode throws if code was not made by Encode.
+      static void Decode(const std::string& code, std::string& message,
+         unsigned threads = 1);
+      static void Decode(const void* code, size_t length, std::string& message,
+         unsigned threads = 1);
    };
 
    // EntropyCalculator uses statistical methods based on the section of
@@ -43,11 +1161,146 @@ namespace shannon1948
    {
    public:
 
+      // Profile holds estimates of the entropy for each N from 1 to a
+      // maximum.  G[N-1] is G_N and F[N-1] is F_N.
+      struct Profile
+      {
+         std::vector<double> G;
+         std::vector<double> F;
+      };
+
+      // Estimates holds G_N as the plug-in sum gives it, and as corrected
+      // by four estimators for the bias of the plug-in sum, which ignores
+      // the N-grams that a message is too short to show and so falls short
+      // of the entropy once the number of possible N-grams approaches the
+      // number of samples.  All are in bits per symbol.
+      struct Estimates
+      {
+         double plug_in;      // G_N itself
+         double miller_madow; // adds (K-1)/2n for the K N-grams seen
+         double jackknife;    // from G_N with each sample left out in turn
+         double grassberger;  // replaces log(c) with a digamma series
+         double chao_shen;    // weights for unseen mass and sampling
+      };
+
+      // BiasCorrectedG_N gives every estimate from one pass over the count
+      // profile.
+      static Estimates BiasCorrectedG_N(
+         const std::string& message, size_t N, unsigned threads = 1);
+      static Estimates BiasCorrectedG_N(const void* message, size_t length,
+         size_t N, unsigned threads = 1);
+      static Estimates BiasCorrectedG_N(const NGramCounter& counter);
+      static Estimates BiasCorrectedG_N(const CountProfile& profile);
+
       // G_N uses the simpler, but less precise formula to calculate entropy.
       // G_N = -(1/N)*sum(p(B_i)*log2(p(B_i))), where the sum is over all
       // sequences B_i containing N symbols.  As N grows, the limit approaches
       // the entropy, H.  symbols is the number of symbols possible in the
       // string.
-      static double G_N(std::string message, size_t N);
+      // threads is the number of threads to count the N-grams with.
+      static double G_N(
+         const std::string& message, size_t N, unsigned threads = 1);
+
+      // G_N of a message held in any buffer of bytes.  The message is read
+      // in place, without being copied.
+      static double G_N(const void* message, size_t length, size_t N,
+         unsigned threads = 1);
+
+      static double G_N(const char* message, size_t N)
+      {
+         return G_N(message, strlen(message), N);
+      }
+
+#ifdef SHANNON1948_STRING_VIEW
+      static double G_N(std::string_view message, size_t N)
+      {
+         return G_N(message.data(), message.length(), N);
+      }
+#endif
+
+      // G_N of a message held in a contiguous range of byte-sized elements,
+      // such as a std::vector<char> or std::array<unsigned char, n>.
+      template <typename ContiguousIterator>
+      static double G_N(
+         ContiguousIterator begin, ContiguousIterator end, size_t N)
+      {
+         static_assert(sizeof(*begin) == 1, "symbols must be bytes");
+         size_t length = size_t(end - begin);
+         return G_N(length == 0 ? nullptr : &*begin, length, N);
+      }
+
+      // G_N computed from N-gram counts that have already been taken, as
+      // G_N = (log(n) - sum(c*log(c))/n)/N over the count profile of n
+      // samples.
+      static double G_N(const NGramCounter& counter);
+      static double G_N(const CountProfile& profile);
+
+      // F_N is Shannon's sharper estimate, the conditional entropy of the
+      // next symbol given the N-1 symbols before it:
+      // F_N = -sum(p(B_i, S_j)*log2(p_B_i(S_j))), where B_i is a sequence of
+      // N-1 symbols and S_j is the symbol that follows it.  It is found as
+      // F_N = N*G_N - (N-1)*G_(N-1), with the (N-1)-gram counts derived from
+      // the N-gram counts, so the message is scanned only once.  F_N
+      // approaches H faster than G_N does.
+      static double F_N(
+         const std::string& message, size_t N, unsigned threads = 1);
+      static double F_N(const void* message, size_t length, size_t N,
+         unsigned threads = 1);
+
+      // F_N computed from N-gram counts that have already been taken.
+      static double F_N(const NGramCounter& counter);
+
+      // BitG_N is G_N of the bits of a message, such as the output of a
+      // random number generator, in bits of entropy per bit.  Bit N-grams
+      // cross byte boundaries.  N must be at most 64.
+      static double BitG_N(const void* message, size_t length, size_t N,
+         unsigned threads = 1);
+
+      // EntropyProfile calculates G_N and F_N for every N up to max_N with
+      // one scan of the message.  The max_N-grams are counted and each
+      // shorter order is found from the next longer one.  If the max_N-grams
+      // do not fit in 64 bits, the counts of every order are instead read
+      // from a suffix array of the message.  F_N is found from G_N using
+      // F_N = N*G_N - (N-1)*G_(N-1), with F_1 = G_1.
+      static Profile EntropyProfile(
+         const std::string& message, size_t max_N, unsigned threads = 1);
+      static Profile EntropyProfile(const void* message, size_t length,
+         size_t max_N, unsigned threads = 1);
+
+      // BitEntropyProfile is EntropyProfile over the bits of a message, as
+      // for BitG_N.
+      static Profile BitEntropyProfile(const void* message, size_t length,
+         size_t max_N, unsigned threads = 1);
+
+      // LempelZivH estimates the entropy rate from the lengths of repeated
+      // matches, as Kontoyiannis et al. do: if L_i is one more than the
+      // length of the longest match of the message at i that also begins
+      // before i, then H = n/sum(L_i/log2(i+1)) over the n positions after
+      // the first.  The matches are read from a suffix array in time and
+      // memory linear in the length of the message, so long-range structure
+      // is captured without tables of N-grams.  threads is the number of
+      // threads to find the alphabet with.
+      static double LempelZivH(
+         const std::string& message, unsigned threads = 1);
+      static double LempelZivH(
+         const void* message, size_t length, unsigned threads = 1);
+
+      // ContextModelH is the code length of the message under a ContextModel
+      // of the given depth over the symbols that appear in it, in bits per
+      // symbol.  It is an upper bound on the entropy rate that adapts to
+      // however much context the source depends on.
+      static double ContextModelH(const std::string& message, size_t depth,
+         size_t memory = ContextModel::DEFAULT_MEMORY);
+      static double ContextModelH(const void* message, size_t length,
+         size_t depth, size_t memory = ContextModel::DEFAULT_MEMORY);
+
+      // CodedH is the length of the message's code from RansCoder, headers
+      // and frequency tables included, in bits per symbol.  It is a static
+      // order-0 or order-1 bound: it approaches H(X_n | X_n-1) and not the
+      // entropy rate of a source with longer memory, for which it is not
+      // an achievable rate; ContextModelH is.
+      static double CodedH(const std::string& message, unsigned threads = 1);
+      static double CodedH(
+         const void* message, size_t length, unsigned threads = 1);
    };
 }
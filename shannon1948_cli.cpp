@@ -0,0 +1,140 @@
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// shannon1948_cli estimates the entropy of a file.  The file is memory mapped
+// rather than read into a string, and the estimates for a range of N are
+// printed as comma separated values, one line per N.
+
+#include "shannon1948.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <exception>
+
+using namespace shannon1948;
+
+namespace
+{
+   void Usage()
+   {
+      fprintf(stderr,
+         "usage: shannon1948_cli [-n MAX_N | -n MIN_N:MAX_N] [-t THREADS] [-b]"
+         " FILE\n"
+         "\n"
+         "Prints G_N and F_N of the bytes of FILE for N from MIN_N (default 1)\n"
+         "to MAX_N (default 8), counting with THREADS threads (default: one\n"
+         "per processor).  With -b, the symbols are the bits of FILE.\n");
+   }
+
+   // ParseSize reads a positive decimal number that makes up all of text.
+   bool ParseSize(const char* text, size_t& value)
+   {
+      char* end = 0;
+      unsigned long long parsed = strtoull(text, &end, 10);
+      if (end == text || *end != '\0' || parsed == 0 ||
+         parsed > (unsigned long long)size_t(-1))
+      {
+         return false;
+      }
+      value = size_t(parsed);
+      return true;
+   }
+
+   // ParseRange reads either MAX or MIN:MAX.
+   bool ParseRange(const char* text, size_t& min, size_t& max)
+   {
+      const char* colon = strchr(text, ':');
+      if (colon == 0)
+      {
+         min = 1;
+         return ParseSize(text, max);
+      }
+
+      std::string first(text, colon);
+      return ParseSize(first.c_str(), min) && ParseSize(colon + 1, max) &&
+         min <= max;
+   }
+}
+
+int main(int argc, char **argv)
+{
+   size_t min_N = 1;
+   size_t max_N = 8;
+   size_t threads = std::thread::hardware_concurrency();
+   if (threads == 0)
+      threads = 1;
+   bool bits = false;
+   const char* path = 0;
+
+   for (int i = 1; i < argc; i++)
+   {
+      std::string arg = argv[i];
+      bool ok = true;
+
+      if (arg == "-n" && i + 1 < argc)
+         ok = ParseRange(argv[++i], min_N, max_N);
+      else if (arg == "-t" && i + 1 < argc)
+         ok = ParseSize(argv[++i], threads);
+      else if (arg == "-b")
+         bits = true;
+      else if (arg[0] != '-' && path == 0)
+         path = argv[i];
+      else
+         ok = false;
+
+      if (!ok)
+      {
+         Usage();
+         return 2;
+      }
+   }
+
+   if (path == 0)
+   {
+      Usage();
+      return 2;
+   }
+
+   try
+   {
+      MappedFile file(path);
+
+      EntropyCalculator::Profile profile = bits ?
+         EntropyCalculator::BitEntropyProfile(
+            file.Data(), file.Length(), max_N, unsigned(threads)) :
+         EntropyCalculator::EntropyProfile(
+            file.Data(), file.Length(), max_N, unsigned(threads));
+
+      printf("N,G_N,F_N\n");
+      for (size_t N = min_N; N <= max_N; N++)
+      {
+         printf("%u,%.17g,%.17g\n", unsigned(N),
+            profile.G[N - 1], profile.F[N - 1]);
+      }
+   }
+   catch (const std::exception& e)
+   {
+      fprintf(stderr, "shannon1948_cli: %s: %s\n", path, e.what());
+      return 1;
+   }
+
+   return 0;
+}
@@ -19,8 +19,55 @@
 #include "shannon1948.hpp"
 #include "gtest/gtest.h"
 
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+#include <set>
+
 using namespace shannon1948;
 
+namespace
+{
+   // ReferenceG_N is the original std::map implementation of G_N, which the
+   // optimized implementations must agree with to rounding.  The terms are
+   // added with compensated (Neumaier) summation, since a plain sum of a
+   // million of them drifts by more than the tolerance the tests allow.
+   double ReferenceG_N(const std::string& message, size_t N)
+   {
+      std::map<std::string, size_t> sequence_counts;
+      size_t samples = 0;
+      while (samples + N <= message.length())
+         ++sequence_counts[message.substr(samples++, N)];
+
+      double sum = 0.0, compensation = 0.0;
+      for (auto it = sequence_counts.begin();
+         it != sequence_counts.end(); it++)
+      {
+         double p = double(it->second)/samples;
+         double term = -p*log(p);
+         double total = sum + term;
+         if (fabs(sum) >= fabs(term))
+            compensation += (sum - total) + term;
+         else
+            compensation += (term - total) + sum;
+         sum = total;
+      }
+      return (sum + compensation)/N/log(2.0);
+   }
+
+   // RandomMessage makes a message of uniformly chosen symbols.
+   std::string RandomMessage(const std::string& alphabet, size_t length)
+   {
+      std::string message;
+      for (size_t i = 0; i < length; i++)
+         message.push_back(alphabet[rand() % alphabet.length()]);
+      return message;
+   }
+}
+
 TEST(overall_tests, gtest_test)
 {
    EXPECT_TRUE(true) << "Simple test of GTest failed.";
@@ -92,6 +139,474 @@ TEST(entropy_source_tests, test_p_tenth)
       "the probability of this test failing is negligible.";
 }
 
+TEST(random_engine_tests, test_xoshiro256starstar)
+{
+   // the first outputs from the state {1, 2, 3, 4}
+   Xoshiro256StarStar engine(1, 2, 3, 4);
+   EXPECT_EQ(11520u, engine());
+   EXPECT_EQ(0u, engine());
+   EXPECT_EQ(1509978240u, engine());
+   EXPECT_EQ(1215971899390074240u, engine());
+}
+
+TEST(random_engine_tests, test_pcg64)
+{
+   // seeded as in the PCG C library, which gives these outputs
+   Pcg64 engine(42, 0x5851F42D4C957F2Du);
+   EXPECT_EQ(1630384352240786774u, engine());
+   EXPECT_EQ(14159374735643074584u, engine());
+   EXPECT_EQ(2049365518351009218u, engine());
+}
+
+TEST(random_engine_tests, test_standard_engine)
+{
+   // the standard requires this 10000th output of a default std::mt19937_64
+   Mt19937_64 engine;
+   uint64_t words[10000];
+   engine.Fill(words, 10000);
+   EXPECT_EQ(9981545732273789042u, words[9999]);
+}
+
+TEST(random_engine_tests, test_narrow_standard_engine)
+{
+   // a generator with 31 bits per call is called three times per word
+   StandardEngine<std::minstd_rand> engine;
+   std::minstd_rand reference;
+   uint64_t word = 0;
+   engine.Fill(&word, 1);
+   uint64_t expected = 0;
+   for (int i = 0; i < 3; i++)
+      expected = (expected << 30) | ((reference() - 1) & 0x3FFFFFFF);
+   EXPECT_EQ(expected, word);
+}
+
+TEST(random_engine_tests, test_philox4x64)
+{
+   // known answers from the Random123 distribution
+   const uint64_t zero[4] = { 0, 0, 0, 0 };
+   const uint64_t pi_counter[4] = { 0x243F6A8885A308D3u,
+      0x13198A2E03707344u, 0xA4093822299F31D0u, 0x082EFA98EC4E6C89u };
+   const uint64_t pi_key[2] = { 0x452821E638D01377u, 0xBE5466CF34E90C6Cu };
+   uint64_t block[4];
+   Philox4x64::Block(zero, zero, block);
+   EXPECT_EQ(0x16554D9ECA36314Cu, block[0]);
+   EXPECT_EQ(0x7E68B68AEC7BA23Bu, block[3]);
+   Philox4x64::Block(pi_counter, pi_key, block);
+   EXPECT_EQ(0xA528F45403E61D95u, block[0]);
+   EXPECT_EQ(0x57BD43B5E52B7FE6u, block[3]);
+
+   // seeking gives the same words as generating up to them
+   Philox4x64 engine(9, 1), seeker(9, 1);
+   uint64_t words[11];
+   engine.Fill(words, 11);
+   seeker.Seek(6);
+   uint64_t word;
+   seeker.Fill(&word, 1);
+   EXPECT_EQ(words[6], word);
+}
+
+namespace
+{
+   // FailingEngine gives a few words and then fails.
+   class FailingEngine : public RandomEngine
+   {
+   public:
+
+      FailingEngine() : given_(0) {}
+
+      virtual void Fill(uint64_t* words, size_t count)
+      {
+         if (given_ + count > 100)
+            throw std::exception("the engine has failed");
+         for (size_t i = 0; i < count; i++)
+            words[i] = given_++;
+      }
+
+   private:
+
+      size_t given_;
+   };
+
+   // OnesFraction gives the fraction of the bits of words that are set.
+   double OnesFraction(const std::vector<uint64_t>& words)
+   {
+      size_t ones = 0;
+      for (size_t i = 0; i < words.size(); i++)
+         for (uint64_t word = words[i]; word != 0; word &= word - 1)
+            ++ones;
+      return ones/(64.0*words.size());
+   }
+}
+
+TEST(random_engine_tests, test_system_and_hardware_engines)
+{
+   // the bits of true random sources are set half the time, and packed bits
+   // from them have an entropy of one bit per bit
+   std::vector<uint64_t> words(1 << 16);
+   SystemEngine system;
+   system.Fill(&words[0], words.size());
+   EXPECT_NEAR(0.5, OnesFraction(words), 0.005);
+   EXPECT_NEAR(1.0, EntropyCalculator::BitG_N(&words[0], 8*words.size(), 8),
+      0.001);
+
+   const HardwareEngine::Instruction instructions[] =
+      { HardwareEngine::RDRAND, HardwareEngine::RDSEED };
+   for (int i = 0; i < 2; i++)
+   {
+      if (!HardwareEngine::Supported(instructions[i]))
+      {
+         EXPECT_THROW(HardwareEngine engine(instructions[i]), std::exception);
+         continue;
+      }
+      HardwareEngine hardware(instructions[i]);
+      hardware.Fill(&words[0], words.size());
+      EXPECT_NEAR(0.5, OnesFraction(words), 0.005);
+   }
+}
+
+TEST(random_engine_tests, test_buffered_engine)
+{
+   // a buffered engine gives the words of its source in order, whatever
+   // the sizes of the requests
+   Pcg64 source(5), reference(5);
+   BufferedEngine buffered(source, 100);
+   for (size_t count = 1; count < 300; count += 37)
+   {
+      std::vector<uint64_t> words(count), expected(count);
+      buffered.Fill(&words[0], count);
+      reference.Fill(&expected[0], count);
+      EXPECT_EQ(expected, words);
+   }
+
+   // a failure of the source is thrown once its words have run out
+   FailingEngine failing;
+   BufferedEngine failing_buffered(failing, 40);
+   std::vector<uint64_t> words(80);
+   failing_buffered.Fill(&words[0], words.size());
+   EXPECT_EQ(79u, words[79]);
+   EXPECT_THROW(failing_buffered.Fill(&words[0], 1), std::exception);
+}
+
+TEST(entropy_source_tests, test_engine_message)
+{
+   // the same seed gives the same message, and p is respected
+   Xoshiro256StarStar engine1(7), engine2(7);
+   std::string message1, message2;
+   EntropySource::GenerateBinaryMessage(engine1, 0.1, 100000, message1);
+   EntropySource::GenerateBinaryMessage(engine2, 0.1, 100000, message2);
+   EXPECT_EQ(message1, message2);
+   EXPECT_NEAR(0.1, std::count(message1.begin(), message1.end(), 'A')/1e5,
+      0.01);
+
+   Pcg64 pcg(7);
+   std::string all_a;
+   EntropySource::GenerateBinaryMessage(pcg, 1.0, 1000, all_a);
+   EXPECT_EQ(std::string(1000, 'A'), all_a);
+}
+
+TEST(entropy_source_tests, test_bernoulli_words)
+{
+   // the fraction of As is close to p, including p with many binary digits
+   const double ps[] = { 0.0, 0.5, 0.1, 0.75, 1.0/3.0, 0.999, 1.0 };
+   Xoshiro256StarStar engine(11);
+   for (size_t i = 0; i < sizeof(ps)/sizeof(ps[0]); i++)
+   {
+      std::string message;
+      EntropySource::GenerateBinaryMessage(engine, ps[i], 200003, message);
+      ASSERT_EQ(200003u, message.length());
+      double fraction =
+         std::count(message.begin(), message.end(), 'A')/200003.0;
+      EXPECT_NEAR(ps[i], fraction, 0.005) << "p = " << ps[i];
+      EXPECT_EQ(message.length(), size_t(
+         std::count(message.begin(), message.end(), 'A') +
+         std::count(message.begin(), message.end(), 'B')));
+   }
+}
+
+TEST(entropy_source_tests, test_skewed_message)
+{
+   // runs between rare symbols leave the symbols independent, so G_N and
+   // F_N are both H(p), for symbols and packed bits alike
+   const double ps[] = { 0.005, 0.9999 };
+   Xoshiro256StarStar engine(19);
+   for (size_t i = 0; i < 2; i++)
+   {
+      double p = ps[i];
+      double H = -(p*log(p) + (1 - p)*log(1 - p))/log(2.0);
+
+      std::string message;
+      EntropySource::GenerateBinaryMessage(engine, p, 4000000, message);
+      EXPECT_NEAR(p, std::count(message.begin(), message.end(), 'A')/4e6,
+         p < 0.5 ? 0.0003 : 0.001);
+      EXPECT_NEAR(H, EntropyCalculator::G_N(message, 1), 0.1*H);
+      EXPECT_NEAR(H, EntropyCalculator::F_N(message, 3, 1), 0.1*H);
+
+      std::vector<unsigned char> bits(500000);
+      EntropySource::GenerateBinaryBits(engine, p, &bits[0], bits.size());
+      EXPECT_NEAR(H, EntropyCalculator::BitG_N(&bits[0], bits.size(), 4),
+         0.1*H);
+   }
+}
+
+TEST(entropy_source_tests, test_seeded_message_any_threads)
+{
+   // the message depends only on the seed, not on the number of threads
+   std::string message1, message4;
+   EntropySource::GenerateBinaryMessage(5, 0.3, 300001, message1, 1);
+   EntropySource::GenerateBinaryMessage(5, 0.3, 300001, message4, 4);
+   EXPECT_EQ(message1, message4);
+   EXPECT_NEAR(0.3, std::count(message1.begin(), message1.end(), 'A')/300001.0,
+      0.005);
+
+   // and each symbol depends only on its position
+   std::string prefix;
+   EntropySource::GenerateBinaryMessage(5, 0.3, 1000, prefix);
+   EXPECT_EQ(message1.substr(0, 1000), prefix);
+}
+
+TEST(entropy_source_tests, test_alias_table)
+{
+   // every column keeps its own outcome or gives way to its alias so that
+   // each outcome gets exactly its share of the words
+   std::vector<double> weights;
+   weights.push_back(1.0);
+   weights.push_back(0.0);
+   weights.push_back(2.0);
+   weights.push_back(5.0);
+   AliasTable table(weights);
+   ASSERT_EQ(4u, table.Size());
+
+   std::vector<double> shares(4);
+   for (uint64_t column = 0; column < 4; column++)
+      for (uint64_t low = 0; low < 1024; low++)
+      {
+         uint64_t word = (column << 62) | (low << 22);
+         shares[table.Sample(word)] += 1.0/4096;
+      }
+   for (size_t i = 0; i < 4; i++)
+      EXPECT_NEAR(weights[i]/8, shares[i], 1e-9);
+
+   EXPECT_THROW(AliasTable(std::vector<double>()), std::exception);
+   EXPECT_THROW(AliasTable(std::vector<double>(3, 0.0)), std::exception);
+   weights[1] = -1.0;
+   EXPECT_THROW(AliasTable table(weights), std::exception);
+}
+
+TEST(entropy_source_tests, test_large_alphabet_message)
+{
+   // a source of 256 symbols with unequal probabilities has G_1 = H
+   std::string alphabet;
+   std::vector<double> probabilities;
+   double total = 0.0;
+   for (int i = 0; i < 256; i++)
+   {
+      alphabet += char(i);
+      probabilities.push_back(1.0 + i % 7);
+      total += 1.0 + i % 7;
+   }
+   double H = 0.0;
+   for (int i = 0; i < 256; i++)
+      H -= probabilities[i]/total*log(probabilities[i]/total)/log(2.0);
+
+   Pcg64 engine(1);
+   std::string message;
+   EntropySource::GenerateMessage(engine, probabilities, alphabet, 1000000,
+      message);
+   ASSERT_EQ(1000000u, message.length());
+   EXPECT_NEAR(H, EntropyCalculator::G_N(message, 1), 0.001);
+
+   // the seeded version is the same for any number of threads
+   std::string message1, message3;
+   EntropySource::GenerateMessage(8, probabilities, alphabet, 500000,
+      message1, 1);
+   EntropySource::GenerateMessage(8, probabilities, alphabet, 500000,
+      message3, 3);
+   EXPECT_EQ(message1, message3);
+   EXPECT_NEAR(H, EntropyCalculator::G_N(message1, 1), 0.002);
+
+   EXPECT_THROW(EntropySource::GenerateMessage(engine, probabilities, "AB",
+      10, message), std::exception);
+}
+
+namespace
+{
+   // SkewedMarkovSource repeats A with probability 0.9, and follows B with
+   // either symbol equally often.
+   MarkovSource SkewedMarkovSource()
+   {
+      std::vector<std::vector<double> > transitions(2, std::vector<double>(2));
+      transitions[0][0] = 0.9;
+      transitions[0][1] = 0.1;
+      transitions[1][0] = 0.5;
+      transitions[1][1] = 0.5;
+      return MarkovSource(transitions, std::vector<std::string>(2, "AB"));
+   }
+}
+
+TEST(entropy_source_tests, test_markov_message)
+{
+   // the state is the last symbol, so F_N for N >= 2 is the entropy rate
+   MarkovSource source = SkewedMarkovSource();
+   EXPECT_NEAR(5.0/6.0, source.Stationary()[0], 1e-12);
+   double H = 5.0/6.0*-(0.9*log(0.9) + 0.1*log(0.1))/log(2.0) + 1.0/6.0;
+   EXPECT_NEAR(H, source.EntropyRate(), 1e-12);
+
+   Xoshiro256StarStar engine(4);
+   size_t state = 0;
+   std::string message;
+   EntropySource::GenerateMessage(engine, source, state, 2000000, message);
+   for (size_t N = 2; N <= 4; N++)
+      EXPECT_NEAR(H, EntropyCalculator::F_N(message, N, 1), 0.005);
+   EXPECT_GT(EntropyCalculator::G_N(message, 1), H + 0.05);
+}
+
+TEST(entropy_source_tests, test_markov_message_in_pieces)
+{
+   // generating in pieces carries the state from one piece to the next
+   MarkovSource source = SkewedMarkovSource();
+   Pcg64 engine1(6), engine2(6);
+   size_t state1 = 1, state2 = 1;
+   std::string whole, pieces;
+   EntropySource::GenerateMessage(engine1, source, state1, 512, whole);
+   EntropySource::GenerateMessage(engine2, source, state2, 256, pieces);
+   EntropySource::GenerateMessage(engine2, source, state2, 256, pieces);
+   EXPECT_EQ(whole, pieces);
+   EXPECT_EQ(state1, state2);
+
+   std::vector<std::vector<double> > ragged(2, std::vector<double>(1, 1.0));
+   EXPECT_THROW(MarkovSource(ragged, std::vector<std::string>(2, "A")),
+      std::exception);
+   size_t bad_state = 2;
+   EXPECT_THROW(EntropySource::GenerateMessage(engine1, source, bad_state,
+      10, whole), std::exception);
+}
+
+namespace
+{
+   // UnpackSymbols turns packed bits back into the binary message, most
+   // significant bit first.
+   std::string UnpackSymbols(const std::vector<unsigned char>& bytes)
+   {
+      std::string symbols;
+      for (size_t i = 0; i < bytes.size(); i++)
+         for (int j = 7; j >= 0; j--)
+            symbols.push_back(((bytes[i] >> j) & 1) ? 'A' : 'B');
+      return symbols;
+   }
+}
+
+TEST(entropy_source_tests, test_seeded_regions)
+{
+   // any region of the seeded message can be generated on its own
+   std::string whole;
+   EntropySource::GenerateBinaryMessage(12, 0.4, 5000, whole);
+   std::vector<char> region(1234);
+   EntropySource::GenerateBinaryMessage(12, 0.4, 99, region.size(),
+      &region[0], 2);
+   EXPECT_EQ(whole.substr(99, 1234), std::string(&region[0], region.size()));
+
+   // packed bits are the same message, eight symbols to a byte
+   std::vector<unsigned char> bits(300);
+   EntropySource::GenerateBinaryBits(12, 0.4, 5, bits.size(), &bits[0]);
+   EXPECT_EQ(whole.substr(40, 2400), UnpackSymbols(bits));
+
+   std::vector<double> probabilities(3, 1.0);
+   std::string message;
+   EntropySource::GenerateMessage(3, probabilities, "XYZ", 1000, message);
+   EntropySource::GenerateMessage(3, probabilities, "XYZ", 501, 200,
+      &region[0]);
+   EXPECT_EQ(message.substr(501, 200), std::string(&region[0], 200));
+}
+
+TEST(entropy_source_tests, test_letter_model)
+{
+   // a second-order letter model of a Markov message whose state is its
+   // last symbol generates text with the same entropy
+   MarkovSource source = SkewedMarkovSource();
+   Xoshiro256StarStar engine(17);
+   size_t state = 0;
+   std::string corpus;
+   EntropySource::GenerateMessage(engine, source, state, 400000, corpus);
+
+   TextModel model1(corpus.data(), corpus.length(), TextModel::LETTERS, 2);
+   TextModel model3(corpus.data(), corpus.length(), TextModel::LETTERS, 2, 3);
+   EXPECT_EQ(2u, model1.Contexts());
+   EXPECT_EQ(4u, model1.NGrams());
+
+   Pcg64 engine1(1), engine3(1);
+   std::string text1, text3;
+   EntropySource::GenerateText(engine1, model1, 1000000, text1);
+   EntropySource::GenerateText(engine3, model3, 1000000, text3);
+   EXPECT_EQ(text1, text3);
+   EXPECT_NEAR(source.EntropyRate(), EntropyCalculator::F_N(text1, 2, 1),
+      0.01);
+
+   EXPECT_THROW(TextModel(corpus.data(), 1, TextModel::LETTERS, 2),
+      std::exception);
+   EXPECT_THROW(TextModel(corpus.data(), corpus.length(), TextModel::LETTERS,
+      9), std::exception);
+}
+
+TEST(entropy_source_tests, test_word_model)
+{
+   // every pair of words generated follows a pair in the corpus, and a
+   // saved model generates the same text
+   const std::string corpus = "the cat sat on the mat\nthe dog sat on "
+      "the cat  and the cat ran";
+   TextModel model(corpus.data(), corpus.length(), TextModel::WORDS, 2, 2);
+
+   const char* path = "text_model_test.tmp";
+   model.Save(path);
+   {
+      TextModel saved(path);
+      EXPECT_EQ(TextModel::WORDS, saved.GetUnit());
+      EXPECT_EQ(model.NGrams(), saved.NGrams());
+
+      Xoshiro256StarStar engine1(3), engine2(3);
+      std::string text, saved_text;
+      EntropySource::GenerateText(engine1, model, 500, text);
+      EntropySource::GenerateText(engine2, saved, 500, saved_text);
+      EXPECT_EQ(text, saved_text);
+
+      std::set<std::pair<std::string, std::string> > pairs;
+      std::istringstream corpus_words(corpus);
+      std::string last, word;
+      while (corpus_words >> word)
+      {
+         pairs.insert(std::make_pair(last, word));
+         last = word;
+      }
+
+      std::istringstream words(text);
+      size_t count = 0, restarts = 0;
+      for (; words >> word; count++)
+      {
+         if (count != 0 && pairs.count(std::make_pair(last, word)) == 0)
+         {
+            EXPECT_EQ("ran", last); // the end of the corpus
+            ++restarts;
+         }
+         last = word;
+      }
+      EXPECT_EQ(500u, count);
+      EXPECT_LT(restarts, 100u);
+   }
+   remove(path);
+
+   EXPECT_THROW(TextModel("no such file.tmp"), std::exception);
+}
+
+TEST(entropy_source_tests, test_binary_bits)
+{
+   // packed bits are independent, so their entropy per bit is H(p)
+   Pcg64 engine(3);
+   std::vector<unsigned char> bits(1 << 18);
+   EntropySource::GenerateBinaryBits(engine, 0.25, &bits[0], bits.size());
+   double H = -(0.25*log(0.25) + 0.75*log(0.75))/log(2.0);
+   EXPECT_NEAR(H, EntropyCalculator::BitG_N(&bits[0], bits.size(), 1), 0.005);
+   EXPECT_NEAR(H, EntropyCalculator::BitG_N(&bits[0], bits.size(), 8), 0.01);
+}
+
 TEST(entropy_calculator_tests, test_zero_entropy_message)
 {
    // p = 0.0 means that messages should be entirely Bs
@@ -134,3 +649,804 @@ TEST(entropy_calculator_tests, test_max_entropy_message_16)
    EXPECT_NEAR(entropy, 1.0, 0.1) << "If all works as expected, "
       "the probability of this test failing is small.";
 }
+
+TEST(entropy_calculator_tests, test_matches_reference_dense)
+{
+   // small alphabets and N fit in a flat array of counts
+   std::string message = RandomMessage("ACGT", 10000);
+   for (size_t N = 1; N <= 10; N++)
+   {
+      EXPECT_NEAR(ReferenceG_N(message, N),
+         EntropyCalculator::G_N(message, N), 1e-12);
+   }
+}
+
+TEST(entropy_calculator_tests, test_matches_reference_hashed)
+{
+   // 8 symbols * 3 bits * 12 = 36 bit keys, too many for a flat array
+   std::string message = RandomMessage("abcdefgh", 10000);
+   EXPECT_NEAR(ReferenceG_N(message, 12),
+      EntropyCalculator::G_N(message, 12), 1e-12);
+   EXPECT_NEAR(ReferenceG_N(message, 21),
+      EntropyCalculator::G_N(message, 21), 1e-12);
+}
+
+TEST(entropy_calculator_tests, test_matches_reference_wide)
+{
+   // N-grams of more than 64 bits are hashed in full
+   std::string message = RandomMessage("abcdefghijklmnopqrstuvwxyz", 5000);
+   message += message.substr(0, 1000); // make some long N-grams repeat
+   EXPECT_NEAR(ReferenceG_N(message, 14),
+      EntropyCalculator::G_N(message, 14), 1e-12);
+   EXPECT_NEAR(ReferenceG_N(message, 40),
+      EntropyCalculator::G_N(message, 40), 1e-12);
+}
+
+TEST(entropy_calculator_tests, test_counter_across_updates)
+{
+   // N-grams that span two updates are counted
+   std::string message = RandomMessage("xyz", 1000);
+   NGramCounter counter(5, "xyz");
+   counter.Update(message.data(), 3);
+   counter.Update(message.data() + 3, message.length() - 3);
+   EXPECT_EQ(message.length() - 4, counter.Samples());
+   EXPECT_NEAR(ReferenceG_N(message, 5),
+      EntropyCalculator::G_N(counter), 1e-12);
+}
+
+TEST(entropy_calculator_tests, test_message_buffers)
+{
+   // every way of passing the message reads the same symbols
+   std::string message = RandomMessage("AB", 4096);
+   double expected = EntropyCalculator::G_N(message, 6);
+   EXPECT_NEAR(ReferenceG_N(message, 6), expected, 1e-12);
+
+   std::vector<char> vector_message(message.begin(), message.end());
+   EXPECT_EQ(expected, EntropyCalculator::G_N(
+      vector_message.begin(), vector_message.end(), 6));
+   EXPECT_EQ(expected, EntropyCalculator::G_N(
+      (const void*)message.data(), message.length(), 6));
+   EXPECT_EQ(expected, EntropyCalculator::G_N(message.c_str(), 6));
+#ifdef SHANNON1948_STRING_VIEW
+   EXPECT_EQ(expected, EntropyCalculator::G_N(std::string_view(message), 6));
+#endif
+}
+
+TEST(entropy_calculator_tests, test_matches_reference_binary)
+{
+   // two-symbol messages are counted a bit at a time; use a length that is
+   // not a multiple of the block size
+   std::string message = RandomMessage("01", 50001);
+   for (size_t N = 1; N <= 24; N += 3)
+   {
+      EXPECT_NEAR(ReferenceG_N(message, N),
+         EntropyCalculator::G_N(message, N), 1e-12);
+   }
+}
+
+TEST(entropy_calculator_tests, test_symbol_not_in_alphabet)
+{
+   std::string message =
+      RandomMessage("AB", 100) + "C" + RandomMessage("AB", 100);
+   NGramCounter counter(3, "AB");
+   EXPECT_ANY_THROW(counter.Update(message.data(), message.length()));
+}
+
+TEST(entropy_calculator_tests, test_parallel_matches_reference)
+{
+   // chunked counting on several threads gives exactly the serial result,
+   // for each kind of count table
+   std::string binary = RandomMessage("AB", 200*1024 + 7);
+   std::string dna = RandomMessage("ACGT", 200*1024);
+   std::string letters = RandomMessage("abcdefghijklmnopqrstuvwxyz", 200*1024);
+
+   for (unsigned threads = 2; threads <= 3; threads++)
+   {
+      EXPECT_NEAR(ReferenceG_N(binary, 12),
+         EntropyCalculator::G_N(binary, 12, threads), 1e-12);
+      EXPECT_NEAR(ReferenceG_N(dna, 20),
+         EntropyCalculator::G_N(dna, 20, threads), 1e-12);
+      EXPECT_NEAR(ReferenceG_N(letters, 3),
+         EntropyCalculator::G_N(letters, 3, threads), 1e-12);
+      EXPECT_NEAR(ReferenceG_N(letters, 16),
+         EntropyCalculator::G_N(letters, 16, threads), 1e-12);
+   }
+}
+
+TEST(entropy_calculator_tests, test_parallel_update_continues_message)
+{
+   std::string message = RandomMessage("xyz", 300000);
+   NGramCounter counter(9, "xyz");
+   counter.Update(message.data(), 1000);
+   counter.Update(message.data() + 1000, 200000, 4);
+   counter.Update(message.data() + 201000, message.length() - 201000);
+   EXPECT_EQ(message.length() - 8, counter.Samples());
+   EXPECT_NEAR(ReferenceG_N(message, 9),
+      EntropyCalculator::G_N(counter), 1e-12);
+}
+
+TEST(entropy_calculator_tests, test_marginal_counts)
+{
+   // the counts of shorter N-grams are found from the longer ones, so they
+   // are exactly the ones a direct count would give
+   std::string message = RandomMessage("ACGT", 5000);
+   NGramCounter counter(9, "ACGT");
+   counter.Update(message.data(), message.length());
+   for (size_t n = 1; n < 9; n++)
+   {
+      NGramCounter marginal = counter.Marginal(n);
+      EXPECT_EQ(message.length() - n + 1, marginal.Samples());
+      EXPECT_NEAR(ReferenceG_N(message, n),
+         EntropyCalculator::G_N(marginal), 1e-12);
+   }
+}
+
+TEST(entropy_calculator_tests, test_profile_matches_reference)
+{
+   std::string message = RandomMessage("ACGT", 20000);
+   EntropyCalculator::Profile profile =
+      EntropyCalculator::EntropyProfile(message, 12);
+   ASSERT_EQ(12u, profile.G.size());
+   for (size_t N = 1; N <= 12; N++)
+      EXPECT_NEAR(ReferenceG_N(message, N), profile.G[N - 1], 1e-12);
+   EXPECT_EQ(profile.G[0], profile.F[0]);
+   EXPECT_NEAR(12*profile.G[11] - 11*profile.G[10], profile.F[11], 1e-12);
+}
+
+TEST(entropy_calculator_tests, test_suffix_array_profile)
+{
+   // 26 symbols * 5 bits * 20 does not fit in 64 bits, so the profile comes
+   // from a suffix array; include long repeats and a periodic stretch
+   std::string message = RandomMessage("abcdefghijklmnopqrstuvwxyz", 4000);
+   message += message.substr(100, 1500);
+   message += std::string(300, 'q') + "abcabcabcabcabcabcabcabcabcabcabc";
+   message += message.substr(0, 2000);
+
+   EntropyCalculator::Profile profile =
+      EntropyCalculator::EntropyProfile(message, 20);
+   for (size_t N = 1; N <= 20; N++)
+      EXPECT_NEAR(ReferenceG_N(message, N), profile.G[N - 1], 1e-9);
+}
+
+TEST(entropy_calculator_tests, test_conditional_entropy)
+{
+   // F_N agrees with the G_N of the same message
+   std::string message = RandomMessage("ABC", 30000);
+   for (size_t N = 1; N <= 6; N++)
+   {
+      double expected = N == 1 ? ReferenceG_N(message, 1) :
+         N*ReferenceG_N(message, N) - (N - 1)*ReferenceG_N(message, N - 1);
+      EXPECT_NEAR(expected, EntropyCalculator::F_N(message, N), 1e-12);
+   }
+}
+
+TEST(entropy_calculator_tests, test_conditional_entropy_converges)
+{
+   // In a message where each symbol is the one after the last, the next
+   // symbol is known once one symbol has been seen, so F_2 is 0.  G_N only
+   // approaches 0 as log2(3)/N.
+   std::string message;
+   for (int i = 0; i < 3000; i++)
+      message += "xyz";
+   EXPECT_NEAR(0.0, EntropyCalculator::F_N(message, 2), 1e-3);
+   EXPECT_GT(EntropyCalculator::G_N(message, 2), 0.5);
+}
+
+TEST(entropy_calculator_tests, test_bias_corrected_estimates)
+{
+   // with 2^12 possible 12-grams and about as many samples, the plug-in sum
+   // falls well short of 1 bit per symbol and every correction does better
+   Xoshiro256StarStar engine(23);
+   std::string message;
+   EntropySource::GenerateBinaryMessage(engine, 0.5, 5000, message);
+   EntropyCalculator::Estimates estimates =
+      EntropyCalculator::BiasCorrectedG_N(message, 12);
+
+   double plug_in = EntropyCalculator::G_N(message, 12);
+   EXPECT_EQ(plug_in, estimates.plug_in);
+   EXPECT_LT(plug_in, 0.95);
+   const double corrected[] = { estimates.miller_madow, estimates.jackknife,
+      estimates.grassberger, estimates.chao_shen };
+   for (int i = 0; i < 4; i++)
+   {
+      EXPECT_GT(corrected[i], plug_in + 0.02) << i;
+      EXPECT_LT(corrected[i], 1.05) << i;
+   }
+}
+
+TEST(entropy_calculator_tests, test_bias_corrections_by_definition)
+{
+   // Miller-Madow and the jackknife as they are defined, over the counts
+   std::string message = RandomMessage("ABC", 300);
+   const size_t N = 2;
+   std::map<std::string, double> counts;
+   for (size_t i = 0; i + N <= message.length(); i++)
+      counts[message.substr(i, N)] += 1.0;
+   double n = double(message.length() - N + 1);
+
+   struct PlugIn
+   {
+      static double Of(const std::map<std::string, double>& counts, double n)
+      {
+         double H = 0.0;
+         for (auto it = counts.begin(); it != counts.end(); it++)
+            if (it->second > 0.0)
+               H -= it->second/n*log(it->second/n);
+         return H;
+      }
+   };
+
+   double H = PlugIn::Of(counts, n);
+   double left_out = 0.0;
+   for (auto it = counts.begin(); it != counts.end(); it++)
+   {
+      double c = it->second;
+      it->second -= 1.0;
+      left_out += c*PlugIn::Of(counts, n - 1.0);
+      it->second += 1.0;
+   }
+   double jackknife = n*H - (n - 1.0)/n*left_out;
+
+   EntropyCalculator::Estimates estimates =
+      EntropyCalculator::BiasCorrectedG_N(message, N);
+   double bits = N*log(2.0);
+   EXPECT_NEAR(H/bits, estimates.plug_in, 1e-12);
+   EXPECT_NEAR((H + (counts.size() - 1.0)/(2.0*n))/bits,
+      estimates.miller_madow, 1e-12);
+   EXPECT_NEAR(jackknife/bits, estimates.jackknife, 1e-9);
+}
+
+TEST(entropy_calculator_tests, test_count_profile)
+{
+   // AB and BA occur twice, AA and BB once
+   NGramCounter counter(2, "AB");
+   counter.Update("ABABBAA", 7);
+   CountProfile profile(counter);
+   EXPECT_EQ(2u, profile.N());
+   EXPECT_EQ(6u, profile.Samples());
+   EXPECT_EQ(4u, profile.Distinct());
+
+   std::vector<std::pair<uint64_t, uint64_t> > frequencies;
+   profile.Frequencies(frequencies);
+   ASSERT_EQ(2u, frequencies.size());
+   EXPECT_EQ(std::make_pair(uint64_t(1), uint64_t(2)), frequencies[0]);
+   EXPECT_EQ(std::make_pair(uint64_t(2), uint64_t(2)), frequencies[1]);
+   EXPECT_NEAR(4*log(2.0), profile.SumCLogC(), 1e-15);
+   EXPECT_EQ(EntropyCalculator::G_N(counter),
+      EntropyCalculator::G_N(profile));
+
+   // every storage gives the same profile
+   std::string message = RandomMessage("ACGT", 50000);
+   for (size_t N = 3; N <= 40; N += 37)
+   {
+      NGramCounter counter(N, "ACGT");
+      counter.Update(message.data(), message.length());
+      EXPECT_NEAR(ReferenceG_N(message, N),
+         EntropyCalculator::G_N(CountProfile(counter)), 1e-12);
+   }
+}
+
+TEST(entropy_calculator_tests, test_count_profile_large_counts)
+{
+   // counts past the table are summed as they are added
+   CountProfile profile(3);
+   profile.Add(1, 5);
+   profile.Add(100000, 2);
+   profile.Add(1ull << 40);
+   profile.Add(100000);
+   profile.Add(7, 0);
+   EXPECT_EQ(3u, profile.N());
+   EXPECT_EQ(5 + 300000 + (1ull << 40), profile.Samples());
+   EXPECT_EQ(9u, profile.Distinct());
+
+   std::vector<std::pair<uint64_t, uint64_t> > frequencies;
+   profile.Frequencies(frequencies);
+   ASSERT_EQ(3u, frequencies.size());
+   EXPECT_EQ(uint64_t(100000), frequencies[1].first);
+   EXPECT_EQ(uint64_t(3), frequencies[1].second);
+   EXPECT_EQ(uint64_t(1) << 40, frequencies[2].first);
+
+   double c_log_c =
+      3*100000*log(100000.0) + (1ull << 40)*log(double(1ull << 40));
+   EXPECT_NEAR(c_log_c, profile.SumCLogC(), c_log_c*1e-15);
+
+   double n = double(profile.Samples()), H = 0.0;
+   for (size_t i = 0; i < frequencies.size(); i++)
+   {
+      double p = frequencies[i].first/n;
+      H -= frequencies[i].second*p*log(p);
+   }
+   EXPECT_NEAR(H/3/log(2.0), EntropyCalculator::G_N(profile), 1e-12);
+}
+
+TEST(entropy_calculator_tests, test_lempel_ziv_by_definition)
+{
+   // the longest earlier matches, found by comparing every pair of positions
+   std::string messages[] = { RandomMessage("AB", 500),
+      RandomMessage("ACGT", 700), "ABABABABABABAB", "AAAAAAAB", "BA" };
+   for (size_t m = 0; m < sizeof(messages)/sizeof(messages[0]); m++)
+   {
+      const std::string& message = messages[m];
+      size_t n = message.length();
+      double sum = 0.0;
+      for (size_t i = 1; i < n; i++)
+      {
+         size_t longest = 0;
+         for (size_t j = 0; j < i; j++)
+         {
+            size_t length = 0;
+            while (i + length < n && message[j + length] == message[i + length])
+               ++length;
+            longest = std::max(longest, length);
+         }
+         sum += (longest + 1.0)/(log(i + 1.0)/log(2.0));
+      }
+      EXPECT_NEAR((n - 1)/sum, EntropyCalculator::LempelZivH(message), 1e-12);
+   }
+
+   EXPECT_THROW(EntropyCalculator::LempelZivH("A"), std::exception);
+}
+
+TEST(entropy_calculator_tests, test_lempel_ziv_converges)
+{
+   // the estimate approaches the entropy rate slowly, as the matches grow
+   // like the log of the length of the message; a message that repeats
+   // itself at a distance no N-gram table could span has almost none
+   MarkovSource source = SkewedMarkovSource();
+   Xoshiro256StarStar engine(21);
+   std::string message;
+   size_t state = 0;
+   EntropySource::GenerateMessage(engine, source, state, 2000000, message);
+   EXPECT_NEAR(source.EntropyRate(),
+      EntropyCalculator::LempelZivH(message, 2), 0.1);
+
+   std::string block = RandomMessage("ACGT", 10000);
+   std::string repeated;
+   for (size_t i = 0; i < 100; i++)
+      repeated += block;
+   EXPECT_LT(EntropyCalculator::LempelZivH(repeated), 0.05);
+   EXPECT_NEAR(2.0, EntropyCalculator::LempelZivH(block), 0.3);
+}
+
+TEST(entropy_calculator_tests, test_context_model_by_definition)
+{
+   // PPM with escape method C and exclusion, with the counts of every
+   // context kept in maps
+   std::string message = RandomMessage("ABC", 300) + "ABCABCABCD";
+   for (size_t depth = 0; depth <= 3; depth++)
+   {
+      std::map<std::string, std::map<char, double> > counts;
+      double bits = 0.0;
+      for (size_t i = 0; i < message.length(); i++)
+      {
+         char symbol = message[i];
+         size_t longest = std::min(depth, i);
+         std::set<char> excluded;
+         bool found = false;
+         for (size_t k = longest + 1; k-- > 0 && !found; )
+         {
+            const std::map<char, double>& seen =
+               counts[message.substr(i - k, k)];
+            double total = 0.0, distinct = 0.0, count = 0.0;
+            for (auto it = seen.begin(); it != seen.end(); it++)
+            {
+               if (!excluded.insert(it->first).second)
+                  continue;
+               total += it->second;
+               distinct += 1.0;
+               if (it->first == symbol)
+                  count = it->second;
+            }
+            if (count != 0.0)
+               found = true;
+            double p = found ? count : distinct;
+            if (distinct != 0.0)
+               bits -= log(p/(total + distinct))/log(2.0);
+         }
+         if (!found)
+            bits += log(4.0 - excluded.size())/log(2.0);
+
+         for (size_t k = 0; k <= longest; k++)
+            counts[message.substr(i - k, k)][symbol] += 1.0;
+      }
+
+      EXPECT_NEAR(bits/message.length(),
+         EntropyCalculator::ContextModelH(message, depth), 1e-12);
+   }
+
+   EXPECT_THROW(EntropyCalculator::ContextModelH("", 3), std::exception);
+   ContextModel model(3, "AB");
+   EXPECT_THROW(model.H(), std::exception);
+   EXPECT_THROW(model.Update('C'), std::exception);
+}
+
+TEST(entropy_calculator_tests, test_context_model_converges)
+{
+   // the code length approaches the entropy rate from above, and a message
+   // that repeats itself costs little after the first time
+   MarkovSource source = SkewedMarkovSource();
+   Xoshiro256StarStar engine(24);
+   std::string message;
+   size_t state = 0;
+   EntropySource::GenerateMessage(engine, source, state, 1000000, message);
+   double H = EntropyCalculator::ContextModelH(message, 4);
+   EXPECT_GT(H, source.EntropyRate());
+   EXPECT_LT(H, source.EntropyRate() + 0.01);
+
+   std::string block = RandomMessage("ACGT", 10000);
+   std::string repeated;
+   for (size_t i = 0; i < 100; i++)
+      repeated += block;
+   EXPECT_LT(EntropyCalculator::ContextModelH(repeated, 32), 0.1);
+
+   // when the budget is spent the model starts again and keeps coding,
+   // whether the budget fits in one chunk of nodes or spans several
+   std::string random = RandomMessage("ACGT", 300000);
+   const std::string* messages[] = { &repeated, &random };
+   size_t budgets[] = { 1 << 16, 8 << 20 };
+   for (size_t m = 0; m < 2; m++)
+   {
+      const std::string& message = *messages[m];
+      ContextModel model(32, "ACGT", budgets[m]);
+      size_t restarts = 0, nodes = model.Nodes();
+      for (size_t i = 0; i < message.length(); i++)
+      {
+         model.Update(message[i]);
+         EXPECT_LE(model.Nodes(), budgets[m]/16);
+         if (model.Nodes() < nodes)
+         {
+            // the symbol that did not fit is counted in the new trie
+            EXPECT_EQ(2u, model.Nodes());
+            ++restarts;
+         }
+         nodes = model.Nodes();
+      }
+      EXPECT_GT(restarts, 0u);
+      EXPECT_EQ(message.length(), model.Symbols());
+      EXPECT_LT(model.H(), 2.5);
+   }
+}
+
+TEST(entropy_calculator_tests, test_coded_entropy)
+{
+   // an achievable rate, close to the entropy of the source
+   std::string message;
+   EntropySource::GenerateBinaryMessage(25, 0.3, 4000000, message, 2);
+   double H = -(0.3*log(0.3) + 0.7*log(0.7))/log(2.0);
+   double coded = EntropyCalculator::CodedH(message, 2);
+   EXPECT_NEAR(H, coded, 0.01);
+   EXPECT_NEAR(EntropyCalculator::G_N(message, 1), coded, 0.005);
+
+   EXPECT_THROW(EntropyCalculator::CodedH(""), std::exception);
+}
+
+TEST(entropy_stream_tests, test_chunks_match_whole_message)
+{
+   // however the message is split, the stream sees the same N-grams
+   std::string message = RandomMessage("ACGT", 100000);
+   EntropyStream stream(7, "ACGT");
+   for (size_t i = 0; i < message.length(); )
+   {
+      size_t length = std::min(size_t(rand() % 1000), message.length() - i);
+      stream.Update(message.data() + i, length);
+      i += length;
+   }
+
+   EXPECT_EQ(message.length(), stream.Length());
+   EXPECT_NEAR(ReferenceG_N(message, 7), stream.G_N(), 1e-12);
+   EXPECT_NEAR(EntropyCalculator::F_N(message, 7), stream.F_N(), 1e-12);
+}
+
+TEST(entropy_stream_tests, test_threads_keep_counts_between_updates)
+{
+   // the per-thread counts are merged when asked for, and counting carries
+   // on afterwards across the same boundaries
+   std::string message = RandomMessage("ACGT", 300000);
+   EntropyStream stream(5, "ACGT", 3);
+   stream.Update(message.data(), 100001);
+   stream.Update(message.data() + 100001, 49999);
+   EXPECT_EQ(EntropyCalculator::G_N(message.substr(0, 150000), 5),
+      stream.G_N());
+   stream.Update(message.data() + 150000, 2);
+   stream.Update(message.data() + 150002, 149998);
+   EXPECT_EQ(EntropyCalculator::G_N(message, 5), stream.G_N());
+   EXPECT_EQ(message.length() - 4, stream.Counter().Samples());
+}
+
+TEST(entropy_stream_tests, test_any_byte)
+{
+   // without an alphabet, any byte may appear
+   std::string message;
+   for (int i = 0; i < 20000; i++)
+      message.push_back(char(rand() % 256));
+
+   EntropyStream stream(2);
+   stream.Update(message.data(), 12345);
+   EXPECT_NEAR(ReferenceG_N(message.substr(0, 12345), 2), stream.G_N(), 1e-12);
+   stream.Update(message.data() + 12345, message.length() - 12345);
+   EXPECT_NEAR(ReferenceG_N(message, 2), stream.G_N(), 1e-12);
+}
+
+TEST(entropy_stream_tests, test_producer_matches_message)
+{
+   // counting a produced message block by block, pipelined or not, is the
+   // same as counting the whole message
+   std::string message;
+   EntropySource::GenerateBinaryMessage(13, 0.25, 1000000, message);
+
+   BinaryProducer producer1(13, 0.25), producer2(13, 0.25, 2);
+   EntropyStream stream1(12, producer1.Alphabet());
+   EntropyStream stream2(12, producer2.Alphabet(), 2);
+   stream1.Update(producer1, 1000000);
+   stream2.Update(producer2, 400000, true);
+   stream2.Update(producer2, 600000, true);
+   EXPECT_EQ(EntropyCalculator::G_N(message, 12), stream1.G_N());
+   EXPECT_EQ(EntropyCalculator::G_N(message, 12), stream2.G_N());
+   EXPECT_EQ(1000000u, stream2.Length());
+
+   // a Markov source without keeping its message
+   MarkovSource source = SkewedMarkovSource();
+   Xoshiro256StarStar engine(2);
+   MarkovProducer markov(engine, source);
+   EntropyStream stream3(3, markov.Alphabet());
+   stream3.Update(markov, 3000000, true);
+   EXPECT_NEAR(source.EntropyRate(), stream3.F_N(), 0.005);
+}
+
+TEST(entropy_stream_tests, test_pipeline_failures)
+{
+   // a failure on either side of the pipeline is thrown to the caller
+   SymbolProducer bad_producer(1, std::vector<double>(2, 1.0), "XYZ");
+   EntropyStream stream(2, "XYZ");
+   EXPECT_THROW(stream.Update(bad_producer, 1000000, true), std::exception);
+
+   BinaryProducer producer(1, 0.5);
+   EntropyStream wrong_alphabet(2, "A");
+   EXPECT_THROW(wrong_alphabet.Update(producer, 1000000, true),
+      std::exception);
+}
+
+TEST(entropy_monitor_tests, test_window_matches_reference)
+{
+   // 4 symbols * 2 bits * 12 = 24 bit keys are kept in an open-addressed
+   // table, from which N-grams leaving the window are removed
+   std::string message = RandomMessage("ACGT", 20000);
+   const size_t W = 1000;
+   EntropyMonitor monitor(12, W, "ACGT");
+
+   for (size_t i = 0; i < message.length(); i++)
+   {
+      monitor.Update(message[i]);
+      if (i + 1 >= 12 && (i % 997 == 0 || i + 1 == message.length()))
+      {
+         size_t begin = i + 1 > W ? i + 1 - W : 0;
+         EXPECT_NEAR(ReferenceG_N(message.substr(begin, i + 1 - begin), 12),
+            monitor.G_N(), 1e-9);
+      }
+   }
+   EXPECT_TRUE(monitor.Full());
+}
+
+TEST(entropy_monitor_tests, test_detects_degraded_source)
+{
+   // a source that gets stuck shows up within a window
+   const size_t W = 4096;
+   EntropyMonitor monitor(8, W, "AB");
+
+   std::string good;
+   EntropySource::GenerateBinaryMessage(0.5, 10*W, good);
+   monitor.Update(good.data(), good.length());
+   EXPECT_NEAR(1.0, monitor.G_N(), 0.1);
+
+   std::string stuck(W, 'A');
+   monitor.Update(stuck.data(), stuck.length());
+   EXPECT_NEAR(0.0, monitor.G_N(), 1e-9);
+}
+
+namespace
+{
+   // BitString expands each byte to eight '0' or '1' symbols, most
+   // significant bit first.
+   std::string BitString(const std::string& bytes)
+   {
+      std::string bits;
+      for (size_t i = 0; i < bytes.length(); i++)
+         for (int j = 7; j >= 0; j--)
+            bits.push_back(((bytes[i] >> j) & 1) ? '1' : '0');
+      return bits;
+   }
+}
+
+TEST(entropy_calculator_tests, test_bit_entropy)
+{
+   // bit N-grams across byte boundaries, as if each bit were a symbol
+   std::string bytes = RandomMessage("\x01\x13\xF0\x7E", 3001);
+   std::string bits = BitString(bytes);
+   for (size_t N = 1; N <= 21; N += 4)
+   {
+      EXPECT_NEAR(ReferenceG_N(bits, N),
+         EntropyCalculator::BitG_N(bytes.data(), bytes.length(), N), 1e-12);
+   }
+}
+
+TEST(entropy_calculator_tests, test_bit_entropy_parallel)
+{
+   // chunks starting part way into a byte give the serial counts; the
+   // serial counts are checked against the reference above
+   std::string bytes = RandomMessage("\x05\xA0\xFF", 300000);
+   double expected = EntropyCalculator::BitG_N(bytes.data(), 240000, 13);
+
+   NGramCounter counter(13, "01");
+   counter.UpdateBits(bytes.data(), 1);
+   counter.UpdateBits(bytes.data() + 1, 200000, 3);
+   counter.UpdateBits(bytes.data() + 200001, 39999);
+   EXPECT_EQ(8*240000u - 12, counter.Samples());
+   EXPECT_EQ(expected, EntropyCalculator::G_N(counter));
+
+   EntropyCalculator::Profile profile = EntropyCalculator::BitEntropyProfile(
+      bytes.data(), bytes.length(), 13, 4);
+   for (size_t N = 1; N <= 13; N++)
+   {
+      EXPECT_EQ(EntropyCalculator::BitG_N(bytes.data(), bytes.length(), N),
+         profile.G[N - 1]);
+   }
+}
+
+TEST(mapped_file_tests, test_read_mapped_file)
+{
+   const char* path = "mapped_file_test.tmp";
+   std::string message = RandomMessage("AB", 10000);
+   FILE* file = fopen(path, "wb");
+   ASSERT_TRUE(file != 0);
+   fwrite(message.data(), 1, message.length(), file);
+   fclose(file);
+
+   {
+      MappedFile mapped(path);
+      ASSERT_EQ(message.length(), mapped.Length());
+      EXPECT_NEAR(ReferenceG_N(message, 5),
+         EntropyCalculator::G_N(mapped.Data(), mapped.Length(), 5), 1e-12);
+   }
+
+   remove(path);
+}
+
+TEST(mapped_file_tests, test_generate_file)
+{
+   // a generated file holds the seeded message, as symbols or packed bits
+   const char* path = "generate_file_test.tmp";
+   std::string message;
+   EntropySource::GenerateBinaryMessage(21, 0.2, 80000, message);
+
+   EntropySource::GenerateBinaryFile(21, 0.2, 80000, path, 2);
+   {
+      MappedFile mapped(path);
+      EXPECT_EQ(message, std::string(mapped.Data(), mapped.Length()));
+   }
+
+   EntropySource::GenerateBinaryFile(21, 0.2, 10000, path, 1, true);
+   {
+      MappedFile mapped(path);
+      std::vector<unsigned char> bits(mapped.Data(),
+         mapped.Data() + mapped.Length());
+      EXPECT_EQ(message, UnpackSymbols(bits));
+
+      // BitG_N reads the bits in the order they were generated
+      EXPECT_NEAR(EntropyCalculator::G_N(message, 5),
+         EntropyCalculator::BitG_N(mapped.Data(), mapped.Length(), 5),
+         1e-12);
+   }
+
+   remove(path);
+}
+
+TEST(mapped_file_tests, test_output_windows)
+{
+   // windows may begin anywhere, and are written to the file when unmapped
+   const char* path = "shannon1948_output_test.tmp";
+   std::string expected(10000, 'x');
+   {
+      OutputFile file(path, expected.length());
+      EXPECT_EQ(uint64_t(expected.length()), file.Length());
+      const uint64_t offsets[] = { 0, 4095, 7001, 9999 };
+      for (size_t i = 0; i < 4; i++)
+      {
+         uint64_t end = i < 3 ? offsets[i + 1] : expected.length();
+         char* window = file.Map(offsets[i], size_t(end - offsets[i]));
+         for (uint64_t j = offsets[i]; j < end; j++)
+         {
+            expected[size_t(j)] = char('a' + i + j % 7);
+            window[j - offsets[i]] = expected[size_t(j)];
+         }
+      }
+      EXPECT_THROW(file.Map(9000, 1001), std::exception);
+   }
+   {
+      MappedFile mapped(path);
+      EXPECT_EQ(expected, std::string(mapped.Data(), mapped.Length()));
+   }
+   remove(path);
+}
+
+TEST(mapped_file_tests, test_missing_file)
+{
+   EXPECT_ANY_THROW(MappedFile("no such file.tmp"));
+}
+
+TEST(rans_coder_tests, test_round_trip)
+{
+   // short messages, messages of one symbol, and many blocks of each order
+   MarkovSource source = SkewedMarkovSource();
+   Xoshiro256StarStar engine(25);
+   std::string markov;
+   size_t state = 0;
+   EntropySource::GenerateMessage(engine, source, state, 2500000, markov);
+
+   // 200 symbols seen once each need more rounding up than any frequency
+   // can give back
+   std::string rare;
+   for (int c = 0; c < 200; c++)
+      rare.push_back(char(c));
+   for (size_t i = 0; i < 56000; i++)
+      rare.push_back(char(200 + rand() % 56));
+
+   std::string messages[] = { "", "A", "AB", "ABC", "ABCDE",
+      std::string(100000, 'Q'), RandomMessage("AB", 1000),
+      RandomMessage(std::string("\x00\xFF\x80", 3), 5000),
+      RandomMessage("ABCDEFGHIJKLMNOPQRSTUVWXYZ", 3000000), markov, rare };
+   for (size_t m = 0; m < sizeof(messages)/sizeof(messages[0]); m++)
+   {
+      for (unsigned threads = 1; threads <= 3; threads += 2)
+      {
+         std::string code, decoded;
+         RansCoder::Encode(messages[m], code, threads);
+         RansCoder::Decode(code, decoded, threads);
+         EXPECT_EQ(messages[m], decoded);
+      }
+   }
+
+   // order 1 is taken where the symbols depend on the one before
+   std::string code;
+   RansCoder::Encode(markov, code);
+   EXPECT_LT(8.0*code.length()/markov.length(),
+      EntropyCalculator::G_N(markov, 1));
+}
+
+TEST(rans_coder_tests, test_little_endian_header)
+{
+   // the length and block sizes read the same on any host
+   std::string message = RandomMessage("ACGT", 0x10203);
+   std::string code;
+   RansCoder::Encode(message, code);
+   ASSERT_GT(code.length(), 20u);
+   EXPECT_EQ(std::string("SH1948RC"), code.substr(0, 8));
+   EXPECT_EQ(std::string("\x03\x02\x01\x00\x00\x00\x00\x00", 8),
+      code.substr(8, 8));
+
+   size_t size = 0;
+   for (size_t i = 4; i-- > 0; )
+      size = size << 8 | (unsigned char)code[16 + i];
+   EXPECT_EQ(code.length() - 20, size);
+}
+
+TEST(rans_coder_tests, test_corrupt_code)
+{
+   std::string message = RandomMessage("ACGT", 10000);
+   std::string code, decoded;
+   RansCoder::Encode(message, code);
+
+   EXPECT_THROW(RansCoder::Decode(message, decoded), std::exception);
+   EXPECT_THROW(RansCoder::Decode(code.substr(0, code.length() - 1),
+      decoded), std::exception);
+   EXPECT_THROW(RansCoder::Decode(code + "A", decoded), std::exception);
+
+   std::string flipped = code;
+   flipped[flipped.length() - 100] ^= 0x10;
+   EXPECT_THROW(RansCoder::Decode(flipped, decoded), std::exception);
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  int rv = RUN_ALL_TESTS();
+  return rv;
+}